@@ -50,11 +50,12 @@ int32_t in_bounds(struct Image *img, int32_t x, int32_t y) {
 //   y     - y coordinate (pixel row)
 //
 // Returns:
-//   the index of the pixel in the image's data array an 
-//   uint32_t. Returns 0 if coordinates are out of bounds
+//   the index of the pixel in the image's data array as a
+//   uint64_t (computed in 64 bits so that images with more
+//   than 2^32 pixels are addressed correctly)
 //
-uint32_t compute_index(struct Image *img, int32_t x, int32_t y) {
-  return (uint32_t)(y * img->width + x);
+uint64_t compute_index(struct Image *img, int32_t x, int32_t y) {
+  return (uint64_t)((int64_t) y * img->width + x);
 }
 
 //
@@ -79,6 +80,28 @@ int32_t clamp(int32_t val, int32_t min, int32_t max) {
   }
 }
 
+//
+// Constrains an offset computed in 64 bits (such as -y, which
+// overflows int32_t when y is INT32_MIN) so that it is greater
+// than or equal to 0 and less than or equal to max.
+//
+// Parameters:
+//   val - The offset to be clamped.
+//   max - The largest offset allowed.
+//
+// Returns:
+//   the clamped offset as a int32_t
+//
+static int32_t clamp_offset(int64_t val, int32_t max) {
+  if (val < 0) {
+    return 0;
+  } else if (val > max) {
+    return max;
+  } else {
+    return (int32_t) val;
+  }
+}
+
 //
 // Returns the red, green, blue, and alpha components of a 
 // pixel color value.
@@ -157,8 +180,8 @@ uint32_t blend_colors(uint32_t fg, uint32_t bg) {
 //   index - index where the pixel is set
 //   color - uint32_t color value
 //
-void set_pixel(struct Image *img, uint32_t index, uint32_t color) {
-  if (index < img->width * img->height) {
+void set_pixel(struct Image *img, uint64_t index, uint32_t color) {
+  if (index < (uint64_t) img->width * img->height) {
     uint32_t bg_color = img->data[index];
     uint32_t blended_color = blend_colors(color, bg_color);
     img->data[index] = blended_color;
@@ -196,6 +219,24 @@ int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2) {
   return square(distance_x) + square(distance_y);
 }
 
+//
+// Draws a pixel (if it is in bounds) without recording it in
+// the image's dirty region. The drawing functions record the
+// whole area they touch once, and then use this for each pixel.
+//
+// Parameters:
+//   img   - pointer to struct Image
+//   x     - x coordinate (pixel column)
+//   y     - y coordinate (pixel row)
+//   color - uint32_t color value
+//
+void put_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color) {
+  if (in_bounds(img, x, y)) {
+    uint64_t index = compute_index(img, x, y);
+    set_pixel(img, index, color);
+  }
+}
+
 
 ////////////////////////////////////////////////////////////////////////
 // API functions
@@ -211,10 +252,10 @@ int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2) {
 //   color - uint32_t color value
 //
 void draw_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color) {
-  if (in_bounds(img, x, y)) {
-    uint32_t index = compute_index(img, x, y);
-    set_pixel(img, index, color);
+  if (img->dirty != NULL) {
+    image_mark_dirty(img, x, y, 1, 1);
   }
+  put_pixel(img, x, y, color);
 }
 
 //
@@ -233,13 +274,21 @@ void draw_rect(struct Image *img,
   // clamp coordinates to be within image bounds.
   int32_t x_start = clamp(rect->x, 0, img->width);
   int32_t y_start = clamp(rect->y, 0, img->height);
-  int32_t x_end = clamp(rect->x + rect->width, 0, img->width);
-  int32_t y_end = clamp(rect->y + rect->height, 0, img->height);
+  // the end coordinates are computed in 64 bits, since x + width
+  // and y + height can overflow int32_t
+  int64_t right = (int64_t) rect->x + rect->width;
+  int64_t bottom = (int64_t) rect->y + rect->height;
+  int32_t x_end = right < 0 ? 0 : right > img->width ? (int32_t) img->width : (int32_t) right;
+  int32_t y_end = bottom < 0 ? 0 : bottom > img->height ? (int32_t) img->height : (int32_t) bottom;
+
+  if (img->dirty != NULL) {
+    image_mark_dirty(img, x_start, y_start, x_end - x_start, y_end - y_start);
+  }
 
   //draw each pixel in the rect area
   for (int32_t y = y_start; y < y_end; y++) {
     for (int32_t x = x_start; x < x_end; x++) {
-      draw_pixel(img, x, y, color);
+      put_pixel(img, x, y, color);
     }
   }
 }
@@ -260,9 +309,26 @@ void draw_circle(struct Image *img,
                  int32_t x, int32_t y, int32_t r,
                  uint32_t color) {
     int64_t squared_r = square(r);
+
+    // restrict the bounding box to the rows and columns that are
+    // inside the image, so that drawing into a small (clipped)
+    // destination only costs the part of the circle it contains
+    int64_t i_start = -r, i_end = r;
+    int64_t j_start = -r, j_end = r;
+    if (y + i_start < 0) i_start = -(int64_t) y;
+    if (y + i_end >= (int64_t) img->height) i_end = (int64_t) img->height - 1 - y;
+    if (x + j_start < 0) j_start = -(int64_t) x;
+    if (x + j_end >= (int64_t) img->width) j_end = (int64_t) img->width - 1 - x;
+
+    if (img->dirty != NULL) {
+      image_mark_dirty(img, x + j_start, y + i_start, j_end - j_start + 1, i_end - i_start + 1);
+    }
+
     // loop over a square bounding box that contains the circle
-    for (int32_t i = -r; i <= r; i++) {
-        for (int32_t j = -r; j <= r; j++) {
+    // (in 64 bits, as the bounds need not fit in int32_t when the
+    // center is far outside the image)
+    for (int64_t i = i_start; i <= i_end; i++) {
+        for (int64_t j = j_start; j <= j_end; j++) {
             // Calculate the square of the distance from (x, y) to (x+j, y+i)
             int64_t dist = square_dist(x, y, x+j, y+i);
             
@@ -298,20 +364,30 @@ void draw_tile(struct Image *img,
   if (tile->x < 0 || tile->y < 0 || tile->x + tile->width > tilemap->width || tile->y + tile->height > tilemap->height) {
     return;
   }
+  // only visit the part of the tile that lands inside the destination
+  int32_t startY = clamp_offset(-(int64_t) y, tile->height);
+  int32_t endY = clamp_offset((int64_t) img->height - y, tile->height);
+  int32_t startX = clamp_offset(-(int64_t) x, tile->width);
+  int32_t endX = clamp_offset((int64_t) img->width - x, tile->width);
+
+  if (img->dirty != NULL) {
+    image_mark_dirty(img, (int64_t) x + startX, (int64_t) y + startY, endX - startX, endY - startY);
+  }
+
   // Loop through each row of the tile
-  for (int32_t offsetY = 0; offsetY < tile->height; ++offsetY) {
+  for (int32_t offsetY = startY; offsetY < endY; ++offsetY) {
         int32_t sourceY = tile->y + offsetY;
         int32_t destY = y + offsetY;
 
         // Loop through each column of the tile
-        for (int32_t offsetX = 0; offsetX < tile->width; ++offsetX) {
+        for (int32_t offsetX = startX; offsetX < endX; ++offsetX) {
             int32_t sourceX = tile->x + offsetX;
             int32_t destX = x + offsetX;
 
             // Copy pixel to destination if it's in bounds
             if (in_bounds(img, destX, destY)) {
-                int32_t destIndex = compute_index(img, destX, destY);
-                int32_t sourceIndex = compute_index(tilemap, sourceX, sourceY);
+                uint64_t destIndex = compute_index(img, destX, destY);
+                uint64_t sourceIndex = compute_index(tilemap, sourceX, sourceY);
                 img->data[destIndex] = tilemap->data[sourceIndex];
             }
         }
@@ -346,19 +422,29 @@ void draw_sprite(struct Image *img,
     return;
   }
 
-  for (int32_t offsetY = 0; offsetY < sprite->height; ++offsetY) {
+  // only visit the part of the sprite that lands inside the destination
+  int32_t startY = clamp_offset(-(int64_t) y, sprite->height);
+  int32_t endY = clamp_offset((int64_t) img->height - y, sprite->height);
+  int32_t startX = clamp_offset(-(int64_t) x, sprite->width);
+  int32_t endX = clamp_offset((int64_t) img->width - x, sprite->width);
+
+  if (img->dirty != NULL) {
+    image_mark_dirty(img, (int64_t) x + startX, (int64_t) y + startY, endX - startX, endY - startY);
+  }
+
+  for (int32_t offsetY = startY; offsetY < endY; ++offsetY) {
     int32_t sourceY = sprite->y + offsetY;
     int32_t destY = y + offsetY;
 
     // Loop through each column of the sprite using offset
-    for (int32_t offsetX = 0; offsetX < sprite->width; ++offsetX) {
+    for (int32_t offsetX = startX; offsetX < endX; ++offsetX) {
       int32_t sourceX = sprite->x + offsetX;
       int32_t destX = x + offsetX;
 
       // Draw pixel if it is in bounds and not transparent
       uint32_t color = spritemap->data[compute_index(spritemap, sourceX, sourceY)];
       if (in_bounds(img, destX, destY) && get_a(color) > 0) {
-        draw_pixel(img, destX, destY, color);
+        put_pixel(img, destX, destY, color);
       }
     }
   }
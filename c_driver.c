@@ -7,11 +7,73 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "image.h"
 #include "drawing_funcs.h"
+#include "drawlist.h"
+#include "render.h"
+#include "threadpool.h"
 
 #define NUM_IMAGE_SLOTS 8
 
+// default size limit of the image cache (-c), in MiB
+#define DEFAULT_CACHE_MB 256
+
+// optimization passes that can be run on the recorded commands
+#define PASS_CULL     (1u << 0)
+#define PASS_COALESCE (1u << 1)
+#define PASS_SCHEDULE (1u << 2)
+
+// states of an image slot
+#define SLOT_EMPTY      0  // no L command for the slot yet
+#define SLOT_REGISTERED 1  // named by an L command, decoded when first used
+#define SLOT_QUEUED     2  // being decoded on the load pool (-l)
+#define SLOT_DECODED    3  // decoded on first use
+
+// an image slot named by an L command
+struct LoadJob {
+  char filename[256];
+  struct Image *img;
+  int rc;
+  int state;
+  int used;                // whether a T or P command refers to the slot
+};
+
+void load_image_task(void *arg) {
+  struct LoadJob *job = arg;
+  job->rc = read_image(job->filename, job->img);
+}
+
+// Get the image in a slot ready for a T or P command, decoding it
+// now if its L command only registered the filename.
+// Returns 0 if successful, 1 (after printing an error message) if
+// the slot is empty or the image couldn't be read.
+int use_slot(struct LoadJob *slots, int32_t n) {
+  if (n < 0 || n >= NUM_IMAGE_SLOTS || slots[n].state == SLOT_EMPTY) {
+    fprintf(stderr, "Error: invalid image number\n");
+    return 1;
+  }
+  struct LoadJob *job = &slots[n];
+  job->used = 1;
+  if (job->state == SLOT_REGISTERED) {
+    job->rc = read_image(job->filename, job->img);
+    job->state = SLOT_DECODED;
+    if (job->rc != IMG_SUCCESS) {
+      fprintf(stderr, "Error: could not read image\n");
+      return 1;
+    }
+  }
+  // a slot being decoded on the load pool is checked once loading finishes
+  return 0;
+}
+
+double elapsed_ms(const struct timespec *t0, const struct timespec *t1) {
+  return (t1->tv_sec - t0->tv_sec) * 1e3 + (t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+
 void skipws(FILE *in) {
   for (;;) {
     int c = fgetc(in);
@@ -25,11 +87,197 @@ void skipws(FILE *in) {
   }
 }
 
+// Check the result of recording a command in a DrawList.
+// Returns 0 if it was recorded, 1 (after printing an error
+// message) if it couldn't be.
+int check_recorded(int rc) {
+  if (rc != 0) {
+    fprintf(stderr, "Error: out of memory\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Parse a comma-separated list of optimization pass names.
+// Returns 0 if all names are valid, 1 otherwise.
+int parse_passes(char *names, unsigned *passes) {
+  for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+    if (strcmp(name, "cull") == 0) {
+      *passes |= PASS_CULL;
+    } else if (strcmp(name, "coalesce") == 0) {
+      *passes |= PASS_COALESCE;
+    } else if (strcmp(name, "schedule") == 0) {
+      *passes |= PASS_SCHEDULE;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Parse the name of a PNG row filter.
+// Returns 0 if the name is valid, 1 otherwise.
+int parse_filter(const char *name, int *filter) {
+  static const struct {
+    const char *name;
+    int filter;
+  } filters[] = {
+    { "adaptive", IMG_FILTER_ADAPTIVE },
+    { "none", IMG_FILTER_NONE },
+    { "sub", IMG_FILTER_SUB },
+    { "up", IMG_FILTER_UP },
+    { "average", IMG_FILTER_AVERAGE },
+    { "paeth", IMG_FILTER_PAETH },
+  };
+  for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+    if (strcmp(name, filters[i].name) == 0) {
+      *filter = filters[i].filter;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Parse the name of a compression strategy.
+// Returns 0 if the name is valid, 1 otherwise.
+int parse_strategy(const char *name, int *strategy) {
+  static const struct {
+    const char *name;
+    int strategy;
+  } strategies[] = {
+    { "default", IMG_STRATEGY_DEFAULT },
+    { "filtered", IMG_STRATEGY_FILTERED },
+    { "huffman", IMG_STRATEGY_HUFFMAN_ONLY },
+    { "rle", IMG_STRATEGY_RLE },
+    { "fixed", IMG_STRATEGY_FIXED },
+  };
+  for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+    if (strcmp(name, strategies[i].name) == 0) {
+      *strategy = strategies[i].strategy;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Parse an integer option value in the range [lo, hi].
+// Returns 0 if it is valid, 1 otherwise.
+int parse_int(const char *arg, int lo, int hi, int *value) {
+  char *end;
+  long v = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || v < lo || v > hi) {
+    return 1;
+  }
+  *value = (int) v;
+  return 0;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  // -j N: render using N threads, each replaying the commands
+  //       clipped to its own horizontal band of the canvas
+  // -t N: instead bin the commands into N x N pixel screen tiles
+  //       rendered by the -j threads with work stealing
+  // -d:   instead draw commands that don't overlap concurrently
+  //       on a pool of -j threads, following their conflict graph
+  // -l:   decode the images named by L commands in parallel on a
+  //       pool of -j threads while the rest of the input is read
+  //       (otherwise an image is decoded when a T or P command first
+  //       uses it, and images that are never used aren't decoded)
+  // -O passes: run a comma-separated list of optimization passes
+  //       over the recorded commands before rendering
+  //       (coalesce: drop no-op and repeated draws and merge
+  //       adjacent rectangles; cull: remove commands hidden by
+  //       later opaque ones; schedule: group draws from the same
+  //       source image)
+  // -p N: pipeline the stages: decode images in the background as
+  //       with -l, then render the canvas in strips of N rows (on
+  //       the calling thread) while another thread compresses the
+  //       finished strips into the output file
+  // -s N: never hold the whole canvas in memory: render it in
+  //       strips of N rows, replaying the commands clipped to each
+  //       strip, and compress each strip into the output file as
+  //       soon as it is finished (takes precedence over -p)
+  // -c dir: keep the decoded images in a cache in directory dir, so
+  //       that later runs map them instead of decoding the same
+  //       PNG files again
+  // -m N: limit the image cache to N MiB (default 256), evicting the
+  //       least recently used images
+  // -f name: filter the rows of the output file with one PNG filter
+  //       (none, sub, up, average or paeth) instead of choosing the
+  //       best filter for each row (adaptive, the default)
+  // -z N: compress the output file at level N, from 0 (fastest) to
+  //       9 (smallest)
+  // -S name: compress it with a zlib strategy (default, filtered,
+  //       huffman, rle or fixed); rle and huffman are fast
+  // -W N: use a compression window of 2^N bytes (9 to 15)
+  // -M N: let the compressor use memory level N (1 to 9)
+  // -e N: compress the output file on N threads, each compressing
+  //       its own band of rows
+  // -v:   report rendering statistics on stderr
+  unsigned num_threads = 1;
+  uint32_t tile_size = 0;
+  int dag = 0;
+  int parallel_load = 0;
+  uint32_t strip_rows = 0;
+  uint32_t stream_rows = 0;
+  unsigned passes = 0;
+  int verbose = 0;
+  const char *cache_dir = NULL;
+  uint64_t cache_mb = DEFAULT_CACHE_MB;
+  int filter = IMG_FILTER_ADAPTIVE;
+  struct ImageWriteOptions write_opts;
+  init_write_options(&write_opts);
+  int opt, value;
+  while ((opt = getopt(argc, argv, "j:t:dlp:s:O:c:m:f:z:S:W:M:e:v")) != -1) {
+    if (opt == 'j' && parse_int(optarg, 1, INT_MAX, &value) == 0) {
+      num_threads = (unsigned) value;
+    } else if (opt == 't' && parse_int(optarg, 1, INT_MAX, &value) == 0) {
+      tile_size = (uint32_t) value;
+    } else if (opt == 'd') {
+      dag = 1;
+    } else if (opt == 'l') {
+      parallel_load = 1;
+    } else if (opt == 'p' && parse_int(optarg, 1, INT_MAX, &value) == 0) {
+      strip_rows = (uint32_t) value;
+      parallel_load = 1;
+    } else if (opt == 's' && parse_int(optarg, 1, INT_MAX, &value) == 0) {
+      stream_rows = (uint32_t) value;
+    } else if (opt == 'O' && parse_passes(optarg, &passes) == 0) {
+      // passes recorded
+    } else if (opt == 'c') {
+      cache_dir = optarg;
+    } else if (opt == 'm' && parse_int(optarg, 1, INT_MAX, &value) == 0) {
+      cache_mb = (uint64_t) value;
+    } else if (opt == 'f' && parse_filter(optarg, &filter) == 0) {
+      // filter recorded
+    } else if (opt == 'z' && parse_int(optarg, 0, 9, &write_opts.level) == 0) {
+      // level recorded
+    } else if (opt == 'S' && parse_strategy(optarg, &write_opts.strategy) == 0) {
+      // strategy recorded
+    } else if (opt == 'W' && parse_int(optarg, 9, 15, &write_opts.window_bits) == 0) {
+      // window size recorded
+    } else if (opt == 'M' && parse_int(optarg, 1, 9, &write_opts.mem_level) == 0) {
+      // memory level recorded
+    } else if (opt == 'e' && parse_int(optarg, 1, 1024, &write_opts.threads) == 0) {
+      // encoder threads recorded
+    } else if (opt == 'v') {
+      verbose = 1;
+    } else {
+      fprintf(stderr, "Error: invalid command line arguments\n");
+      return 1;
+    }
+  }
+  if (argc - optind != 1) {
     fprintf(stderr, "Error: invalid command line arguments\n");
     return 1;
   }
+  const char *out_filename = argv[optind];
+  image_set_write_filter(filter);
+
+  if (cache_dir != NULL && image_cache_enable(cache_dir, cache_mb << 20) != IMG_SUCCESS) {
+    fprintf(stderr, "Error: could not use image cache directory\n");
+    return 1;
+  }
 
   struct Image canvas = {
     .data = NULL,
@@ -37,7 +285,12 @@ int main(int argc, char **argv) {
     .height = 0,
   };
 
-  struct Image loaded_images[NUM_IMAGE_SLOTS] = {{0,0,NULL}};
+  // with -s the canvas is only sized, and its pixels are never allocated
+  int canvas_sized = 0;
+
+  struct Image loaded_images[NUM_IMAGE_SLOTS] = {{0,0,NULL,NULL,0}};
+  struct LoadJob load_jobs[NUM_IMAGE_SLOTS] = {{ .state = SLOT_EMPTY }};
+  struct ThreadPool *load_pool = parallel_load ? threadpool_create(num_threads) : NULL;
   uint32_t width, height;
   char cmd;
   struct Rect rect;
@@ -45,8 +298,16 @@ int main(int argc, char **argv) {
   int32_t x, y, r, n;
   char filename[256];
 
+  // commands are recorded while the input is read, and rendered
+  // once the whole description has been read successfully
+  struct DrawList list;
+  drawlist_init(&list);
+
   int error = 0;
 
+  struct timespec t_start, t_parsed, t_loaded, t_optimized, t_done;
+  clock_gettime(CLOCK_MONOTONIC, &t_start);
+
   while (!error && scanf(" %c", &cmd) == 1) {
     switch (cmd) {
     case 'S': // "Size", must be the first command
@@ -55,33 +316,44 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error: invalid C command\n");
         break;
       }
-      if (init_image(&canvas, width, height) != IMG_SUCCESS) {
+      // a new canvas replaces the old one along with everything drawn on it
+      free(canvas.data);
+      canvas.data = NULL;
+      canvas_sized = 0;
+      drawlist_clear(&list);
+      if (stream_rows > 0) {
+        canvas.width = width;
+        canvas.height = height;
+        canvas_sized = 1;
+      } else if (init_image(&canvas, width, height) != IMG_SUCCESS) {
         error = 1;
         fprintf(stderr, "Error: could not create canvas\n");
+      } else {
+        canvas_sized = 1;
       }
       break;
 
     case 'R': // "Rectangle"
-      if (canvas.data == NULL) {
+      if (!canvas_sized) {
         error = 1;
         fprintf(stderr, "Error: image size must be specified before drawing operations\n");
       } else if (scanf("%d %d %d %d %x", &rect.x, &rect.y, &rect.width, &rect.height, &color) != 5) {
         error = 1;
         fprintf(stderr, "Error: invalid rectangle\n");
       } else {
-        draw_rect(&canvas, &rect, color);
+        error = check_recorded(drawlist_add_rect(&list, &rect, color));
       }
       break;
 
     case 'C': // "Circle"
-      if (canvas.data == NULL) {
+      if (!canvas_sized) {
         error = 1;
         fprintf(stderr, "Error: image size must be specified before drawing operations\n");
       } else if (scanf("%d %d %d %x", &x, &y, &r, &color) != 4) {
         error = 1;
         fprintf(stderr, "Error: invalid circle\n");
       } else {
-        draw_circle(&canvas, x, y, r, color);
+        error = check_recorded(drawlist_add_circle(&list, x, y, r, color));
       }
       break;
 
@@ -94,12 +366,21 @@ int main(int argc, char **argv) {
         if (scanf("%255s", filename) != 1) {
           error = 1;
           fprintf(stderr, "Error: error reading image filename\n");
-        } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data != NULL) {
+        } else if (n < 0 || n >= NUM_IMAGE_SLOTS || load_jobs[n].state != SLOT_EMPTY) {
           error = 1;
           fprintf(stderr, "Error: invalid image number\n");
-        } else if (read_image(filename, &loaded_images[n]) != IMG_SUCCESS) {
-          error = 1;
-          fprintf(stderr, "Error: could not read image\n");
+        } else {
+          struct LoadJob *job = &load_jobs[n];
+          strcpy(job->filename, filename);
+          job->img = &loaded_images[n];
+          job->state = SLOT_REGISTERED;
+          if (load_pool != NULL) {
+            // decode in the background; the result is checked before rendering
+            job->state = SLOT_QUEUED;
+            if (threadpool_submit(load_pool, load_image_task, job) != 0) {
+              load_image_task(job);
+            }
+          }
         }
       }
       break;
@@ -108,11 +389,10 @@ int main(int argc, char **argv) {
       if (scanf("%d %d %d %d %d %d %d", &n, &rect.x, &rect.y, &rect.width, &rect.height, &x, &y) != 7) {
         error = 1;
         fprintf(stderr, "Error: invalid T command\n");
-      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
+      } else if (use_slot(load_jobs, n) != 0) {
         error = 1;
-        fprintf(stderr, "Error: invalid image number\n");
       } else {
-        draw_tile(&canvas, x, y, &loaded_images[n], &rect);
+        error = check_recorded(drawlist_add_tile(&list, x, y, &loaded_images[n], &rect));
       }
       break;
 
@@ -120,11 +400,10 @@ int main(int argc, char **argv) {
       if (scanf("%d %d %d %d %d %d %d", &n, &rect.x, &rect.y, &rect.width, &rect.height, &x, &y) != 7) {
         error = 1;
         fprintf(stderr, "Error: invalid P command\n");
-      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
+      } else if (use_slot(load_jobs, n) != 0) {
         error = 1;
-        fprintf(stderr, "Error: invalid image number\n");
       } else {
-        draw_sprite(&canvas, x, y, &loaded_images[n], &rect);
+        error = check_recorded(drawlist_add_sprite(&list, x, y, &loaded_images[n], &rect));
       }
       break;
 
@@ -134,15 +413,126 @@ int main(int argc, char **argv) {
     }
   }
 
-  // try to write output file
-  if (!error && write_image(argv[1], &canvas) != IMG_SUCCESS) {
+  clock_gettime(CLOCK_MONOTONIC, &t_parsed);
+  t_loaded = t_parsed;
+
+  if (load_pool != NULL) {
+    // wait for the images still being decoded
+    unsigned load_threads = threadpool_size(load_pool);
+    threadpool_destroy(load_pool);
+    clock_gettime(CLOCK_MONOTONIC, &t_loaded);
+
+    // as without -l, only images that are used have to be readable
+    int num_loaded = 0;
+    for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+      if (load_jobs[i].state == SLOT_QUEUED) {
+        num_loaded++;
+        if (load_jobs[i].used && load_jobs[i].rc != IMG_SUCCESS && !error) {
+          error = 1;
+          fprintf(stderr, "Error: could not read image\n");
+        }
+      }
+    }
+    if (verbose) {
+      fprintf(stderr, "images: %d decoded on %u threads, waited %.3f ms after reading input\n",
+              num_loaded, load_threads, elapsed_ms(&t_parsed, &t_loaded));
+    }
+  } else if (verbose) {
+    int num_registered = 0, num_decoded = 0;
+    for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+      num_registered += (load_jobs[i].state != SLOT_EMPTY);
+      num_decoded += (load_jobs[i].state == SLOT_DECODED);
+    }
+    fprintf(stderr, "images: %d of %d loaded images decoded on first use\n",
+            num_decoded, num_registered);
+  }
+
+  if (!error && (passes & PASS_COALESCE)) {
+    struct OptStats opt_stats;
+    error = check_recorded(drawlist_coalesce(&list, canvas.width, canvas.height, &opt_stats));
+    if (!error && verbose) {
+      report_opt_stats(stderr, "coalesce", &opt_stats);
+    }
+  }
+
+  if (!error && (passes & PASS_CULL)) {
+    struct OptStats opt_stats;
+    error = check_recorded(drawlist_cull_occluded(&list, canvas.width, canvas.height, &opt_stats));
+    if (!error && verbose) {
+      report_opt_stats(stderr, "cull", &opt_stats);
+    }
+  }
+
+  if (!error && (passes & PASS_SCHEDULE)) {
+    struct OptStats opt_stats;
+    error = check_recorded(drawlist_schedule(&list, canvas.width, canvas.height, &opt_stats));
+    if (!error && verbose) {
+      report_opt_stats(stderr, "schedule", &opt_stats);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t_optimized);
+
+  if (!error && (stream_rows > 0 || strip_rows > 0)) {
+    // render and write the output file together
+    struct PipelineStats pipeline_stats;
+    int rc = (stream_rows > 0)
+      ? render_streamed(canvas.width, canvas.height, &list, out_filename, &write_opts, stream_rows,
+                        &pipeline_stats)
+      : render_pipelined(&canvas, &list, out_filename, &write_opts, strip_rows, &pipeline_stats);
+    if (rc != IMG_SUCCESS) {
+      error = 1;
+      fprintf(stderr, "Error: could not write image\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_done);
+    if (!error && verbose) {
+      report_pipeline_stats(stderr, &pipeline_stats);
+      fprintf(stderr, "stages: parse %.3f ms, decode wait %.3f ms, optimize %.3f ms, "
+              "render+encode %.3f ms, total %.3f ms\n",
+              elapsed_ms(&t_start, &t_parsed), elapsed_ms(&t_parsed, &t_loaded),
+              elapsed_ms(&t_loaded, &t_optimized), elapsed_ms(&t_optimized, &t_done),
+              elapsed_ms(&t_start, &t_done));
+    }
+  } else if (!error) {
+    struct TileStats stats;
+    struct DagStats dag_stats;
+    struct ReplayOptions opts = {
+      .num_threads = num_threads,
+      .tile_size = tile_size,
+      .tile_stats = (verbose && tile_size > 0 && !dag) ? &stats : NULL,
+      .dag = dag,
+      .dag_stats = verbose ? &dag_stats : NULL,
+    };
+    drawlist_replay_ex(&canvas, &list, &opts);
+    if (opts.tile_stats != NULL) {
+      report_tile_stats(stderr, &stats);
+      free_tile_stats(&stats);
+    }
+    if (dag && verbose) {
+      report_dag_stats(stderr, &dag_stats);
+    }
+  }
+
+  // try to write output file (-p and -s have written it already)
+  if (!error && strip_rows == 0 && stream_rows == 0 &&
+      write_image_ex(out_filename, &canvas, &write_opts) != IMG_SUCCESS) {
     error = 1;
     fprintf(stderr, "Error: could not write image\n");
   }
 
+  if (cache_dir != NULL && verbose) {
+    struct ImageCacheStats cache_stats;
+    image_cache_get_stats(&cache_stats);
+    fprintf(stderr, "image cache: %u hits, %u misses, %u stored, %u evicted (%.1f MiB)\n",
+            cache_stats.hits, cache_stats.misses, cache_stats.stores, cache_stats.evictions,
+            cache_stats.evicted_bytes / 1048576.0);
+  }
+
+  drawlist_free(&list);
   free(canvas.data);
   for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
-    free(loaded_images[i].data);
+    // images mapped from the cache are unmapped
+    free_image(&loaded_images[i]);
   }
 
   return (error != 0); // returns 0 IFF there was no error
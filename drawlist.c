@@ -0,0 +1,112 @@
+/*
+ * Implementation of the recorded display list (DrawList) API.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "drawlist.h"
+#include "render.h"
+
+void drawlist_init(struct DrawList *list) {
+  memset(list, 0, sizeof(*list));
+}
+
+void drawlist_free(struct DrawList *list) {
+  free(list->cmds);
+  drawlist_init(list);
+}
+
+void drawlist_clear(struct DrawList *list) {
+  list->num_cmds = 0;
+}
+
+//
+// Append a command to a list, growing its array if necessary.
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+//
+static int append_command(struct DrawList *list, const struct Command *cmd) {
+  if (list->num_cmds == list->capacity) {
+    size_t new_cap = (list->capacity == 0) ? 64 : list->capacity * 2;
+    struct Command *grown = realloc(list->cmds, new_cap * sizeof(struct Command));
+    if (grown == NULL) {
+      return -1;
+    }
+    list->cmds = grown;
+    list->capacity = new_cap;
+  }
+  list->cmds[list->num_cmds++] = *cmd;
+  return 0;
+}
+
+//
+// Find the index of an image in a list's image table, adding it
+// if it isn't there yet.
+//
+// Returns:
+//   the index, or -1 if the table is full
+//
+static int image_index(struct DrawList *list, struct Image *img) {
+  for (unsigned i = 0; i < list->num_images; i++) {
+    if (list->images[i] == img) {
+      return (int) i;
+    }
+  }
+  if (list->num_images == DRAWLIST_MAX_IMAGES) {
+    return -1;
+  }
+  list->images[list->num_images] = img;
+  return (int) list->num_images++;
+}
+
+int drawlist_add_rect(struct DrawList *list, const struct Rect *rect, uint32_t color) {
+  struct Command cmd = { .type = CMD_RECT, .rect = *rect, .color = color };
+  return append_command(list, &cmd);
+}
+
+int drawlist_add_circle(struct DrawList *list, int32_t x, int32_t y, int32_t r, uint32_t color) {
+  struct Command cmd = { .type = CMD_CIRCLE, .r = r, .x = x, .y = y, .color = color };
+  return append_command(list, &cmd);
+}
+
+//
+// Record a tile or sprite command.
+//
+static int add_blit(struct DrawList *list, char type, int32_t x, int32_t y,
+                    struct Image *src, const struct Rect *region) {
+  int src_index = image_index(list, src);
+  if (src_index < 0) {
+    return -1;
+  }
+  struct Command cmd = { .type = type, .src = (uint8_t) src_index, .rect = *region, .x = x, .y = y };
+  return append_command(list, &cmd);
+}
+
+int drawlist_add_tile(struct DrawList *list, int32_t x, int32_t y,
+                      struct Image *tilemap, const struct Rect *tile) {
+  return add_blit(list, CMD_TILE, x, y, tilemap, tile);
+}
+
+int drawlist_add_sprite(struct DrawList *list, int32_t x, int32_t y,
+                        struct Image *spritemap, const struct Rect *sprite) {
+  return add_blit(list, CMD_SPRITE, x, y, spritemap, sprite);
+}
+
+void drawlist_replay(struct Image *img, const struct DrawList *list) {
+  render_serial(img, list);
+}
+
+void drawlist_replay_ex(struct Image *img, const struct DrawList *list,
+                        const struct ReplayOptions *opts) {
+  if (opts->dag) {
+    render_dag(img, list, opts->num_threads, opts->dag_stats);
+  } else if (opts->tile_size > 0) {
+    render_tiles(img, list, opts->num_threads, opts->tile_size, opts->tile_stats);
+  } else {
+    render_bands(img, list, opts->num_threads);
+  }
+}
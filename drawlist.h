@@ -0,0 +1,259 @@
+/*
+ * Header of the recorded display list (DrawList) API: drawing
+ * commands are recorded into a list and replayed onto an image
+ * later, optionally in parallel.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef DRAWLIST_H
+#define DRAWLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "image.h"
+#include "drawing_funcs.h"
+
+// kinds of recorded drawing commands
+#define CMD_RECT    'R'
+#define CMD_CIRCLE  'C'
+#define CMD_TILE    'T'
+#define CMD_SPRITE  'P'
+
+// maximum number of distinct tilemap/spritemap images a list can refer to
+#define DRAWLIST_MAX_IMAGES 256
+
+// A single recorded drawing command (32 bytes).
+//   rect   - the rectangle (R) or the source region (T, P)
+//   r      - circle radius (C), shares storage with rect
+//   x, y   - circle center (C) or destination location (T, P)
+//   color  - color value (R, C)
+//   src    - index of the tilemap or spritemap in the list's
+//            image table (T, P)
+struct Command {
+  char type;
+  uint8_t src;
+  union {
+    struct Rect rect;
+    int32_t r;
+  };
+  int32_t x, y;
+  uint32_t color;
+};
+
+// A recorded sequence of drawing commands, along with the table of
+// source images referred to by its tile and sprite commands.
+struct DrawList {
+  struct Command *cmds;
+  size_t num_cmds;
+  size_t capacity;
+  struct Image *images[DRAWLIST_MAX_IMAGES];
+  unsigned num_images;
+};
+
+struct TileStats;
+struct DagStats;
+
+// How drawlist_replay_ex should replay a list.
+//   num_threads - number of threads to render with (0 or 1 for one)
+//   tile_size   - if non-zero, bin the commands into tile_size x
+//                 tile_size screen tiles (see render_tiles);
+//                 otherwise split the canvas into horizontal bands
+//   tile_stats  - if not NULL and tiles are used, receives per-tile
+//                 statistics (release with free_tile_stats)
+//   dag         - if non-zero, draw the commands on a thread pool as
+//                 allowed by their conflict graph (see render_dag);
+//                 tile_size is then ignored
+//   dag_stats   - if not NULL and dag is set, receives statistics
+//                 about the graph and the achieved parallelism
+struct ReplayOptions {
+  unsigned num_threads;
+  uint32_t tile_size;
+  struct TileStats *tile_stats;
+  int dag;
+  struct DagStats *dag_stats;
+};
+
+// Initialize an empty DrawList.
+//
+// Parameters:
+//   list - pointer to DrawList to initialize
+void drawlist_init(struct DrawList *list);
+
+// Free the memory used by a DrawList. The source images it refers
+// to are not freed.
+//
+// Parameters:
+//   list - pointer to DrawList
+void drawlist_free(struct DrawList *list);
+
+// Remove all commands from a DrawList (the image table is kept).
+//
+// Parameters:
+//   list - pointer to DrawList
+void drawlist_clear(struct DrawList *list);
+
+// Record a command drawing a rectangle (see draw_rect).
+//
+// Parameters:
+//   list  - pointer to DrawList
+//   rect  - pointer to struct Rect
+//   color - uint32_t color value
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+int drawlist_add_rect(struct DrawList *list, const struct Rect *rect, uint32_t color);
+
+// Record a command drawing a circle (see draw_circle).
+//
+// Parameters:
+//   list  - pointer to DrawList
+//   x     - x coordinate of circle's center
+//   y     - y coordinate of circle's center
+//   r     - radius of circle
+//   color - uint32_t color value
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+int drawlist_add_circle(struct DrawList *list, int32_t x, int32_t y, int32_t r, uint32_t color);
+
+// Record a command drawing a tile (see draw_tile). The tilemap
+// must remain valid until the list is no longer replayed.
+//
+// Parameters:
+//   list    - pointer to DrawList
+//   x       - x coordinate of location where tile should be copied
+//   y       - y coordinate of location where tile should be copied
+//   tilemap - pointer to Image (the tilemap)
+//   tile    - pointer to Rect (the tile)
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated or the
+//   list already refers to DRAWLIST_MAX_IMAGES other images
+int drawlist_add_tile(struct DrawList *list, int32_t x, int32_t y,
+                      struct Image *tilemap, const struct Rect *tile);
+
+// Record a command drawing a sprite (see draw_sprite). The spritemap
+// must remain valid until the list is no longer replayed.
+//
+// Parameters:
+//   list      - pointer to DrawList
+//   x         - x coordinate of location where sprite should be copied
+//   y         - y coordinate of location where sprite should be copied
+//   spritemap - pointer to Image (the spritemap)
+//   sprite    - pointer to Rect (the sprite)
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated or the
+//   list already refers to DRAWLIST_MAX_IMAGES other images
+int drawlist_add_sprite(struct DrawList *list, int32_t x, int32_t y,
+                        struct Image *spritemap, const struct Rect *sprite);
+
+// Replay all of the commands in a list, in order, onto an image.
+//
+// Parameters:
+//   img  - pointer to destination struct Image
+//   list - pointer to DrawList
+void drawlist_replay(struct Image *img, const struct DrawList *list);
+
+// Replay all of the commands in a list onto an image, as specified
+// by a set of options. The result is identical to drawlist_replay,
+// including the area recorded in the image's dirty region (if it is
+// tracked), though that may be larger when threads are used.
+//
+// Parameters:
+//   img  - pointer to destination struct Image
+//   list - pointer to DrawList
+//   opts - pointer to ReplayOptions
+void drawlist_replay_ex(struct Image *img, const struct DrawList *list,
+                        const struct ReplayOptions *opts);
+
+// Statistics reported by the DrawList optimization passes.
+//   cmds_before     - number of commands before the pass
+//   cmds_after      - number of commands after the pass
+//   removed         - commands dropped entirely
+//   merged          - commands merged into an earlier one
+//   shrunk          - commands reduced to a smaller region
+//   split           - commands replaced by several smaller ones
+//   area_before     - destination pixels drawn before the pass
+//   area_eliminated - destination pixels no longer drawn
+//   moved           - commands moved to a different position
+//   switches_before - changes of source image between consecutive
+//                     tile/sprite commands before the pass
+//   switches_after  - the same, after the pass
+struct OptStats {
+  size_t cmds_before, cmds_after;
+  size_t removed, merged, shrunk, split;
+  uint64_t area_before, area_eliminated;
+  size_t moved, switches_before, switches_after;
+};
+
+// Remove, or shrink to their visible parts, commands whose pixels
+// are completely overwritten by later fully opaque commands (opaque
+// rectangles and circles, tiles, and sprites whose pixels are all
+// opaque). The final pixels produced by replaying the list onto a
+// canvas of the specified size are unchanged.
+//
+// Parameters:
+//   list   - pointer to DrawList
+//   width  - canvas width
+//   height - canvas height
+//   stats  - if not NULL, receives statistics about the pass
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in
+//   which case the list is unchanged)
+int drawlist_cull_occluded(struct DrawList *list, uint32_t width, uint32_t height,
+                           struct OptStats *stats);
+
+// Simplify a list without changing the final pixels produced by
+// replaying it onto a canvas of the specified size: commands that
+// can't change any pixel of the canvas (zero-area, off-canvas, or
+// with an invalid source region) are dropped, rectangles are clipped
+// to the canvas, exact repeats of opaque draws that nothing was drawn
+// over in between are removed, and same-colored opaque rectangles
+// that abut or overlap to form a larger rectangle are merged.
+//
+// Parameters:
+//   list   - pointer to DrawList
+//   width  - canvas width
+//   height - canvas height
+//   stats  - if not NULL, receives statistics about the pass
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in
+//   which case the list is unchanged)
+int drawlist_coalesce(struct DrawList *list, uint32_t width, uint32_t height,
+                      struct OptStats *stats);
+
+// Reorder the commands in a list so that tile and sprite draws from
+// the same source image (and nearby source regions) run together,
+// keeping the source image's pixels in cache. A command is only moved
+// ahead of commands whose destination boxes don't overlap its own,
+// so the final pixels produced by
+// replaying the list onto a canvas of the specified size are
+// unchanged.
+//
+// Parameters:
+//   list   - pointer to DrawList
+//   width  - canvas width
+//   height - canvas height
+//   stats  - if not NULL, receives statistics about the pass
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in
+//   which case the list is unchanged)
+int drawlist_schedule(struct DrawList *list, uint32_t width, uint32_t height,
+                      struct OptStats *stats);
+
+// Print the statistics reported by an optimization pass.
+//
+// Parameters:
+//   out   - stream to print to
+//   name  - name of the pass
+//   stats - pointer to OptStats
+void report_opt_stats(FILE *out, const char *name, const struct OptStats *stats);
+
+#endif // DRAWLIST_H
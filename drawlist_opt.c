@@ -0,0 +1,595 @@
+/*
+ * Implementation of the optimization passes over recorded
+ * DrawList command sequences.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "drawlist.h"
+#include "render.h"
+
+// maximum number of visible pieces tracked for one command while
+// subtracting occluders from it
+#define MAX_PIECES 64
+
+// number of earlier commands the coalescing pass looks back through
+// for a duplicate or a rectangle to merge with
+#define COALESCE_WINDOW 64
+
+// number of earlier commands the scheduling pass looks back through
+// for a draw from the same source image
+#define SCHEDULE_WINDOW 256
+
+////////////////////////////////////////////////////////////////////////
+// Helper functions
+////////////////////////////////////////////////////////////////////////
+
+static uint64_t rect_area(const struct Rect *r) {
+  return (uint64_t) r->width * (uint64_t) r->height;
+}
+
+// Compute the integer square root of n, the largest x with x*x <= n,
+// by Newton's method.
+static uint64_t isqrt(uint64_t n) {
+  uint64_t x = n, y = n / 2 + (n & 1);
+  while (y < x) {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+  return x;
+}
+
+//
+// Subtract rectangle b from rectangle a.
+//
+// Parameters:
+//   a   - rectangle to subtract from
+//   b   - rectangle to subtract
+//   out - array receiving up to 4 disjoint rectangles covering a - b
+//
+// Returns:
+//   the number of rectangles stored in out
+//
+static int subtract_rect(const struct Rect *a, const struct Rect *b, struct Rect out[4]) {
+  if (!rects_intersect(a, b)) {
+    out[0] = *a;
+    return 1;
+  }
+
+  int32_t ax1 = a->x + a->width, ay1 = a->y + a->height;
+  int32_t bx1 = b->x + b->width, by1 = b->y + b->height;
+  int n = 0;
+
+  // full-width strips above and below b, then the parts left and right of b
+  if (b->y > a->y) {
+    out[n++] = (struct Rect) { a->x, a->y, a->width, b->y - a->y };
+  }
+  if (by1 < ay1) {
+    out[n++] = (struct Rect) { a->x, by1, a->width, ay1 - by1 };
+  }
+  int32_t my0 = b->y > a->y ? b->y : a->y;
+  int32_t my1 = by1 < ay1 ? by1 : ay1;
+  if (b->x > a->x) {
+    out[n++] = (struct Rect) { a->x, my0, b->x - a->x, my1 - my0 };
+  }
+  if (bx1 < ax1) {
+    out[n++] = (struct Rect) { bx1, my0, ax1 - bx1, my1 - my0 };
+  }
+  return n;
+}
+
+//
+// Determine whether a tile or sprite command draws anything, using
+// the same source region checks as draw_tile and draw_sprite.
+//
+static int blit_is_valid(const struct DrawList *list, const struct Command *cmd) {
+  const struct Image *src = list->images[cmd->src];
+  const struct Rect *r = &cmd->rect;
+
+  if (r->width <= 0 || r->height <= 0) {
+    return 0;
+  }
+  if (cmd->type == CMD_TILE) {
+    return r->x >= 0 && r->y >= 0 &&
+           (uint32_t) (r->x + r->width) <= src->width &&
+           (uint32_t) (r->y + r->height) <= src->height;
+  }
+  return r->x >= 0 && r->y >= 0 &&
+         (int64_t) r->x + r->width - 1 < src->width &&
+         (int64_t) r->y + r->height - 1 < src->height;
+}
+
+// kinds of sprite source regions, by the alpha values of their pixels
+#define SPRITE_OPAQUE   0   // every pixel is opaque: drawing overwrites
+#define SPRITE_BINARY   1   // every pixel is opaque or fully transparent
+#define SPRITE_BLENDED  2   // some pixels are blended with the destination
+
+//
+// Classify a sprite's source region by the alpha values of its
+// pixels (one of the SPRITE_* values).
+//
+static int sprite_alpha_kind(const struct DrawList *list, const struct Command *cmd) {
+  const struct Image *src = list->images[cmd->src];
+  int kind = SPRITE_OPAQUE;
+  for (int32_t y = cmd->rect.y; y < cmd->rect.y + cmd->rect.height; y++) {
+    const uint32_t *row = src->data + (uint64_t) y * src->width;
+    for (int32_t x = cmd->rect.x; x < cmd->rect.x + cmd->rect.width; x++) {
+      uint32_t alpha = row[x] & 0xFF;
+      if (alpha == 0) {
+        kind = SPRITE_BINARY;
+      } else if (alpha != 0xFF) {
+        return SPRITE_BLENDED;
+      }
+    }
+  }
+  return kind;
+}
+
+//
+// Determine the region of the canvas a command is guaranteed to
+// overwrite with values that don't depend on what was there before.
+//
+// Returns:
+//   1 if the command is an occluder (the region is stored in *region),
+//   0 otherwise
+//
+static int occluded_region(const struct DrawList *list, const struct Command *cmd,
+                           uint32_t width, uint32_t height, struct Rect *region) {
+  switch (cmd->type) {
+  case CMD_RECT:
+    if ((cmd->color & 0xFF) != 0xFF) {
+      return 0;
+    }
+    break;
+  case CMD_CIRCLE: {
+    if ((cmd->color & 0xFF) != 0xFF || cmd->r < 0) {
+      return 0;
+    }
+    // largest square centered on the circle with all of its
+    // pixels inside the circle: 2*s*s <= r*r
+    int64_t s = (int64_t) isqrt((uint64_t) cmd->r * (uint64_t) cmd->r / 2);
+    // the square can be far larger than the canvas, so it is clipped
+    // in 64 bits rather than made into a rect command
+    int64_t x0 = (int64_t) cmd->x - s, y0 = (int64_t) cmd->y - s;
+    int64_t x1 = (int64_t) cmd->x + s + 1, y1 = (int64_t) cmd->y + s + 1;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > width) x1 = width;
+    if (y1 > height) y1 = height;
+    if (x0 >= x1 || y0 >= y1) {
+      return 0;
+    }
+    *region = (struct Rect) { (int32_t) x0, (int32_t) y0, (int32_t) (x1 - x0), (int32_t) (y1 - y0) };
+    return 1;
+  }
+  case CMD_TILE:
+    // tiles are copied without blending
+    if (!blit_is_valid(list, cmd)) {
+      return 0;
+    }
+    break;
+  case CMD_SPRITE:
+    if (!blit_is_valid(list, cmd) || sprite_alpha_kind(list, cmd) != SPRITE_OPAQUE) {
+      return 0;
+    }
+    break;
+  default:
+    return 0;
+  }
+
+  return clipped_command_bounds(cmd, width, height, region);
+}
+
+//
+// Make a copy of a rect, tile or sprite command restricted to a
+// part of its (clipped) destination region.
+//
+static struct Command restrict_command(const struct Command *cmd, const struct Rect *part) {
+  struct Command out = *cmd;
+  if (cmd->type == CMD_RECT) {
+    out.rect = *part;
+  } else {
+    out.rect.x += part->x - cmd->x;
+    out.rect.y += part->y - cmd->y;
+    out.rect.width = part->width;
+    out.rect.height = part->height;
+    out.x = part->x;
+    out.y = part->y;
+  }
+  return out;
+}
+
+//
+// Determine whether two commands draw exactly the same thing.
+//
+static int same_command(const struct Command *a, const struct Command *b) {
+  if (a->type != b->type) {
+    return 0;
+  }
+  switch (a->type) {
+  case CMD_RECT:
+    return memcmp(&a->rect, &b->rect, sizeof(struct Rect)) == 0 && a->color == b->color;
+  case CMD_CIRCLE:
+    return a->x == b->x && a->y == b->y && a->r == b->r && a->color == b->color;
+  default:
+    return a->src == b->src && memcmp(&a->rect, &b->rect, sizeof(struct Rect)) == 0 &&
+           a->x == b->x && a->y == b->y;
+  }
+}
+
+//
+// Determine whether drawing a command a second time (with nothing
+// drawn over it in between) leaves the pixels unchanged.
+//
+static int command_is_idempotent(const struct DrawList *list, const struct Command *cmd) {
+  switch (cmd->type) {
+  case CMD_RECT:
+  case CMD_CIRCLE:
+    return (cmd->color & 0xFF) == 0xFF;
+  case CMD_TILE:
+    return 1;
+  default:
+    return sprite_alpha_kind(list, cmd) != SPRITE_BLENDED;
+  }
+}
+
+//
+// Determine whether the union of two rectangles is itself a
+// rectangle, i.e. they line up along one side and touch or overlap,
+// or one contains the other.
+//
+// Returns:
+//   1 if so (the union is stored in *u), 0 otherwise, including when
+//   the union is too wide or tall for struct Rect
+//
+static int merge_rects(const struct Rect *a, const struct Rect *b, struct Rect *u) {
+  int64_t ax1 = (int64_t) a->x + a->width, ay1 = (int64_t) a->y + a->height;
+  int64_t bx1 = (int64_t) b->x + b->width, by1 = (int64_t) b->y + b->height;
+
+  if (rect_contains(a, b)) {
+    *u = *a;
+  } else if (rect_contains(b, a)) {
+    *u = *b;
+  } else if (a->x == b->x && a->width == b->width && b->y <= ay1 && a->y <= by1) {
+    int32_t y0 = a->y < b->y ? a->y : b->y;
+    int64_t height = (ay1 > by1 ? ay1 : by1) - y0;
+    if (height > INT32_MAX) {
+      return 0;
+    }
+    *u = (struct Rect) { a->x, y0, a->width, (int32_t) height };
+  } else if (a->y == b->y && a->height == b->height && b->x <= ax1 && a->x <= bx1) {
+    int32_t x0 = a->x < b->x ? a->x : b->x;
+    int64_t width = (ax1 > bx1 ? ax1 : bx1) - x0;
+    if (width > INT32_MAX) {
+      return 0;
+    }
+    *u = (struct Rect) { x0, a->y, (int32_t) width, a->height };
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+static int is_blit(const struct Command *cmd) {
+  return cmd->type == CMD_TILE || cmd->type == CMD_SPRITE;
+}
+
+//
+// Order draws from the same source image by their source region,
+// top to bottom and then left to right.
+//
+static int source_before(const struct Command *a, const struct Command *b) {
+  return a->rect.y < b->rect.y || (a->rect.y == b->rect.y && a->rect.x < b->rect.x);
+}
+
+//
+// Count the places where consecutive tile/sprite draws use
+// different source images.
+//
+static size_t count_source_switches(const struct Command *cmds, size_t n) {
+  size_t switches = 0;
+  const struct Command *last = NULL;
+  for (size_t i = 0; i < n; i++) {
+    if (is_blit(&cmds[i])) {
+      if (last != NULL && last->src != cmds[i].src) {
+        switches++;
+      }
+      last = &cmds[i];
+    }
+  }
+  return switches;
+}
+
+// growable array of commands used while building the result of a pass
+struct CommandBuf {
+  struct Command *cmds;
+  size_t n, cap;
+};
+
+static int push_command(struct CommandBuf *buf, const struct Command *cmd) {
+  if (buf->n == buf->cap) {
+    size_t new_cap = buf->cap ? buf->cap * 2 : 64;
+    struct Command *grown = realloc(buf->cmds, new_cap * sizeof(struct Command));
+    if (grown == NULL) {
+      return -1;
+    }
+    buf->cmds = grown;
+    buf->cap = new_cap;
+  }
+  buf->cmds[buf->n++] = *cmd;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Optimization passes
+////////////////////////////////////////////////////////////////////////
+
+int drawlist_cull_occluded(struct DrawList *list, uint32_t width, uint32_t height,
+                           struct OptStats *stats) {
+  struct OptStats st = { .cmds_before = list->num_cmds };
+  struct CommandBuf out = { 0 };
+  struct Rect *occluders = malloc((list->num_cmds + 1) * sizeof(struct Rect));
+  size_t num_occluders = 0;
+  int rc = 0;
+
+  if (occluders == NULL) {
+    return -1;
+  }
+
+  // walk backwards, so that the occluders drawn after a command
+  // are known when it is visited; the result is built in reverse
+  for (size_t i = list->num_cmds; i-- > 0; ) {
+    const struct Command *cmd = &list->cmds[i];
+    struct Rect box;
+
+    if (!clipped_command_bounds(cmd, width, height, &box) ||
+        ((cmd->type == CMD_TILE || cmd->type == CMD_SPRITE) && !blit_is_valid(list, cmd))) {
+      // draws nothing on the canvas
+      st.removed++;
+      continue;
+    }
+    st.area_before += rect_area(&box);
+
+    // subtract the later occluders from the command's region
+    struct Rect pieces[MAX_PIECES], next[MAX_PIECES];
+    int num_pieces = 1;
+    pieces[0] = box;
+    for (size_t k = num_occluders; k-- > 0 && num_pieces > 0; ) {
+      if (!rects_intersect(&occluders[k], &box)) {
+        continue;
+      }
+      int n = 0;
+      for (int p = 0; p < num_pieces; p++) {
+        if (n + 4 + (num_pieces - p - 1) > MAX_PIECES) {
+          // too fragmented; keep this piece whole (leaving room for
+          // the remaining ones), which only means that less is culled
+          next[n++] = pieces[p];
+          continue;
+        }
+        n += subtract_rect(&pieces[p], &occluders[k], &next[n]);
+      }
+      memcpy(pieces, next, n * sizeof(struct Rect));
+      num_pieces = n;
+    }
+
+    uint64_t visible = 0;
+    for (int p = 0; p < num_pieces; p++) {
+      visible += rect_area(&pieces[p]);
+    }
+
+    if (visible == 0) {
+      st.removed++;
+      st.area_eliminated += rect_area(&box);
+    } else if (visible < rect_area(&box) && cmd->type != CMD_CIRCLE && num_pieces <= 4) {
+      // draw only the visible parts
+      for (int p = 0; p < num_pieces && rc == 0; p++) {
+        struct Command part = restrict_command(cmd, &pieces[p]);
+        rc = push_command(&out, &part);
+      }
+      if (num_pieces == 1) {
+        st.shrunk++;
+      } else {
+        st.split++;
+      }
+      st.area_eliminated += rect_area(&box) - visible;
+    } else {
+      rc = push_command(&out, cmd);
+    }
+    if (rc != 0) {
+      break;
+    }
+
+    struct Rect region;
+    if (occluded_region(list, cmd, width, height, &region)) {
+      // a region inside an existing occluder adds nothing
+      int redundant = 0;
+      for (size_t k = 0; k < num_occluders && !redundant; k++) {
+        redundant = rect_contains(&occluders[k], &region);
+      }
+      if (!redundant) {
+        occluders[num_occluders++] = region;
+      }
+    }
+  }
+  free(occluders);
+
+  if (rc != 0) {
+    free(out.cmds);
+    return -1;
+  }
+
+  // restore the original order
+  for (size_t i = 0; i < out.n / 2; i++) {
+    struct Command tmp = out.cmds[i];
+    out.cmds[i] = out.cmds[out.n - 1 - i];
+    out.cmds[out.n - 1 - i] = tmp;
+  }
+  free(list->cmds);
+  list->cmds = out.cmds;
+  list->num_cmds = out.n;
+  list->capacity = out.cap;
+
+  st.cmds_after = out.n;
+  if (stats != NULL) {
+    *stats = st;
+  }
+  return 0;
+}
+
+int drawlist_coalesce(struct DrawList *list, uint32_t width, uint32_t height,
+                      struct OptStats *stats) {
+  struct OptStats st = { .cmds_before = list->num_cmds };
+  struct CommandBuf out = { 0 };
+
+  for (size_t i = 0; i < list->num_cmds; i++) {
+    struct Command cmd = list->cmds[i];
+    struct Rect box;
+
+    if (!clipped_command_bounds(&cmd, width, height, &box) ||
+        ((cmd.type == CMD_TILE || cmd.type == CMD_SPRITE) && !blit_is_valid(list, &cmd))) {
+      // zero-area, off-canvas, or invalid source region
+      st.removed++;
+      continue;
+    }
+    st.area_before += rect_area(&box);
+    if (cmd.type == CMD_RECT) {
+      // the part of a rectangle outside the canvas is never drawn
+      cmd.rect = box;
+    }
+    int opaque_rect = cmd.type == CMD_RECT && (cmd.color & 0xFF) == 0xFF;
+
+    // look back through the commands that don't overlap this one:
+    // it can be moved to just after any of them without changing
+    // the result
+    int absorbed = 0;
+    size_t window = 0;
+    for (size_t k = out.n; k-- > 0 && window++ < COALESCE_WINDOW && !absorbed; ) {
+      struct Command *prev = &out.cmds[k];
+      struct Rect prev_box, merged;
+
+      if (same_command(prev, &cmd) && command_is_idempotent(list, &cmd)) {
+        // drawing it again would change nothing
+        st.removed++;
+        st.area_eliminated += rect_area(&box);
+        absorbed = 1;
+      } else if (opaque_rect && prev->type == CMD_RECT && prev->color == cmd.color &&
+                 merge_rects(&prev->rect, &cmd.rect, &merged)) {
+        // same opaque color: draw both as one rectangle
+        st.merged++;
+        st.area_eliminated += rect_area(&prev->rect) + rect_area(&cmd.rect) - rect_area(&merged);
+        prev->rect = merged;
+        absorbed = 1;
+      } else if (!clipped_command_bounds(prev, width, height, &prev_box) ||
+                 rects_intersect(&prev_box, &box)) {
+        break;
+      }
+    }
+
+    if (!absorbed && push_command(&out, &cmd) != 0) {
+      free(out.cmds);
+      return -1;
+    }
+  }
+
+  free(list->cmds);
+  list->cmds = out.cmds;
+  list->num_cmds = out.n;
+  list->capacity = out.cap;
+
+  st.cmds_after = out.n;
+  if (stats != NULL) {
+    *stats = st;
+  }
+  return 0;
+}
+
+int drawlist_schedule(struct DrawList *list, uint32_t width, uint32_t height,
+                      struct OptStats *stats) {
+  struct OptStats st = { .cmds_before = list->num_cmds, .cmds_after = list->num_cmds };
+  size_t n = list->num_cmds;
+  struct Command *out = malloc((n + 1) * sizeof(struct Command));
+  struct Rect *boxes = malloc((n + 1) * sizeof(struct Rect));
+  uint8_t *visible = malloc(n + 1);
+
+  if (out == NULL || boxes == NULL || visible == NULL) {
+    free(out);
+    free(boxes);
+    free(visible);
+    return -1;
+  }
+  st.switches_before = count_source_switches(list->cmds, n);
+
+  // A command depends on every earlier command whose (clipped)
+  // destination box overlaps its own: whether either one blends or
+  // overwrites, the overlapping pixels depend on their order. Each
+  // tile or sprite is moved back past the commands it doesn't depend
+  // on, to join the nearest earlier run of draws from the same source
+  // image, in source region order within the run.
+  for (size_t i = 0; i < n; i++) {
+    const struct Command *cmd = &list->cmds[i];
+    struct Rect box;
+    int vis = clipped_command_bounds(cmd, width, height, &box);
+    size_t pos = i;
+
+    if (is_blit(cmd)) {
+      int in_run = 0;
+      size_t window = 0;
+      for (size_t k = i; k-- > 0 && window++ < SCHEDULE_WINDOW; ) {
+        int same_src = is_blit(&out[k]) && out[k].src == cmd->src;
+        if (in_run && !same_src) {
+          break;
+        }
+        if (vis && visible[k] && rects_intersect(&boxes[k], &box)) {
+          break;
+        }
+        if (same_src) {
+          if (!in_run || source_before(cmd, &out[k])) {
+            pos = in_run ? k : k + 1;
+          }
+          in_run = 1;
+        }
+      }
+    }
+
+    if (pos < i) {
+      memmove(&out[pos + 1], &out[pos], (i - pos) * sizeof(struct Command));
+      memmove(&boxes[pos + 1], &boxes[pos], (i - pos) * sizeof(struct Rect));
+      memmove(&visible[pos + 1], &visible[pos], i - pos);
+      st.moved++;
+    }
+    out[pos] = *cmd;
+    boxes[pos] = box;
+    visible[pos] = (uint8_t) vis;
+  }
+
+  st.switches_after = count_source_switches(out, n);
+  free(list->cmds);
+  list->cmds = out;
+  list->capacity = n + 1;
+  free(boxes);
+  free(visible);
+
+  if (stats != NULL) {
+    *stats = st;
+  }
+  return 0;
+}
+
+void report_opt_stats(FILE *out, const char *name, const struct OptStats *stats) {
+  int reordered = stats->moved > 0 || stats->switches_before > 0;
+  if (stats->area_before > 0 || stats->removed > 0 || !reordered) {
+    fprintf(out, "%s: %zu -> %zu commands (%zu removed, %zu merged, %zu shrunk, %zu split), "
+            "%llu of %llu pixels eliminated (%.1f%%)\n",
+            name, stats->cmds_before, stats->cmds_after,
+            stats->removed, stats->merged, stats->shrunk, stats->split,
+            (unsigned long long) stats->area_eliminated, (unsigned long long) stats->area_before,
+            stats->area_before ? 100.0 * stats->area_eliminated / stats->area_before : 0.0);
+  }
+  if (reordered) {
+    fprintf(out, "%s: %zu commands moved, %zu -> %zu source image switches\n",
+            name, stats->moved, stats->switches_before, stats->switches_after);
+  }
+}
@@ -1,9 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "pnglite.h"
+#include "png_unfilter.h"
+#include "png_filter.h"
 #include "image.h"
+#include "image_cache.h"
+#include "drawing_funcs.h"
 
-int png_init_called;
+// pnglite is initialized exactly once, even if images are read and
+// written from several threads at the same time
+static pthread_once_t png_init_once = PTHREAD_ONCE_INIT;
+
+static void init_pnglite(void) {
+  png_init(0, 0);
+}
+
+// filter of the rows of written images (the IMG_FILTER_* values are
+// the PNG_FILTER_* ones)
+static int write_filter = PNG_FILTER_ADAPTIVE;
 
 int is_little_endian(void) {
   int32_t x = 1;
@@ -17,7 +32,12 @@ uint32_t byteswap(uint32_t val) {
 }
 
 int init_image(struct Image *img, uint32_t width, uint32_t height) {
-  unsigned num_pixels = width * height;
+  // pixel counts and buffer sizes are computed in 64 bits so that
+  // very large canvases don't silently wrap around
+  uint64_t num_pixels = (uint64_t) width * height;
+  if (num_pixels > SIZE_MAX / sizeof(uint32_t)) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
   uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
   if (pixel_data == NULL) {
@@ -25,7 +45,7 @@ int init_image(struct Image *img, uint32_t width, uint32_t height) {
   }
 
   // initialize every pixel to opaque black
-  for (uint32_t i = 0; i < num_pixels; i++) {
+  for (uint64_t i = 0; i < num_pixels; i++) {
     pixel_data[i] = 0x000000FFU;
   }
 
@@ -33,119 +53,480 @@ int init_image(struct Image *img, uint32_t width, uint32_t height) {
   img->width = width;
   img->height = height;
   img->data = pixel_data;
+  img->dirty = NULL;
+  img->mapped_len = 0;
   return IMG_SUCCESS;
 }
 
-int read_image(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+// destination of the rows decoded by read_image and
+// read_image_region: the pixels of rows y0 to y1-1, starting at
+// column x0, are stored
+struct DecodeTarget {
+  png_t *png;
+  uint32_t *pixels;
+  uint32_t x0, y0, y1;
+  uint32_t width;
+  int bpp;            // bytes per pixel of pixels converted directly
+  int lut_depth;      // bits per pixel of pixels converted through lut (or 0)
+  int lut_ready;
+  uint32_t lut[256];  // RGBA value of each palette index or gray level
+};
+
+// Build the table of the RGBA values of the palette entries (or gray
+// levels) of an indexed (or grayscale) image, applying the image's
+// transparency information.
+//
+// Returns:
+//   PNG_NO_ERROR if successful, or an error code if an indexed
+//   image has no palette
+static int build_lut(const png_t *png, uint32_t *lut) {
+  unsigned num_values = 1u << png->depth;
+
+  if (png->color_type == PNG_INDEXED) {
+    if (png->palette_len == 0) {
+      return PNG_HEADER_ERROR;
+    }
+    for (unsigned i = 0; i < num_values; i++) {
+      // indices past the end of the palette are invalid; they are
+      // shown as opaque black rather than rejected
+      if (i >= png->palette_len) {
+        lut[i] = 0x000000FFU;
+        continue;
+      }
+      const unsigned char *rgb = png->palette + i * 3;
+      uint32_t a = i < png->trns_len ? png->trns[i] : 255;
+      lut[i] = ((uint32_t) rgb[0] << 24) | ((uint32_t) rgb[1] << 16) | ((uint32_t) rgb[2] << 8) | a;
+    }
+  } else {
+    // gray levels are scaled to 8 bits; tRNS holds a single fully
+    // transparent level
+    int has_key = png->trns_len >= 2;
+    unsigned key = has_key ? ((unsigned) png->trns[0] << 8) | png->trns[1] : 0;
+    for (unsigned i = 0; i < num_values; i++) {
+      uint32_t g = i * 255 / (num_values - 1);
+      uint32_t a = (has_key && i == key) ? 0 : 255;
+      lut[i] = (g << 24) | (g << 16) | (g << 8) | a;
+    }
   }
+  return PNG_NO_ERROR;
+}
 
-  png_t png;
+// Convert a decoded row of PNG pixel data (big-endian truecolor or
+// gray and alpha pixels, or palette indices or gray levels) to
+// host-order RGBA pixels in the image's pixel buffer. The row was
+// unfiltered just before, so it is still in the cache.
+static int convert_row(unsigned char *row, unsigned y, void *user_pointer) {
+  struct DecodeTarget *target = user_pointer;
+  if (y < target->y0) {
+    // rows above the region are only needed to unfilter the next ones
+    return PNG_NO_ERROR;
+  }
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
-    return IMG_ERR_COULD_NOT_OPEN;
+  uint32_t *dst = target->pixels + (uint64_t) (y - target->y0) * target->width;
+  if (target->lut_depth) {
+    // the palette and transparency chunks precede the image data
+    if (!target->lut_ready) {
+      int rc = build_lut(target->png, target->lut);
+      if (rc != PNG_NO_ERROR) {
+        return rc;
+      }
+      target->lut_ready = 1;
+    }
+    indices_to_rgba(target->lut_depth, row, target->x0, target->lut, dst, target->width);
+  } else {
+    pixels_to_rgba(target->bpp, row + (size_t) target->x0 * target->bpp, dst, target->width);
+  }
+
+  // stop decoding after the region's last row
+  return y + 1 == target->y1 ? PNG_DONE : PNG_NO_ERROR;
+}
+
+int image_set_write_filter(int filter) {
+  if (filter != IMG_FILTER_ADAPTIVE && (filter < IMG_FILTER_NONE || filter > IMG_FILTER_PAETH)) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  write_filter = filter;
+  return IMG_SUCCESS;
+}
+
+void image_set_crc_policy(int policy) {
+  switch (policy) {
+  case IMG_CRC_VERIFY:
+    png_set_crc_policy(PNG_CRC_VERIFY);
+    break;
+  case IMG_CRC_SKIP:
+    png_set_crc_policy(PNG_CRC_SKIP);
+    break;
+  case IMG_CRC_BACKGROUND:
+    png_set_crc_policy(PNG_CRC_BACKGROUND);
+    break;
   }
+}
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
+// Decode the pixels of the region of an opened PNG given by roi, or
+// of the whole image if roi is NULL. The PNG is closed.
+static int decode_png(png_t *png, const struct Rect *roi, struct Image *img) {
+  // 8-bit truecolor and gray and alpha images are converted pixel by
+  // pixel, palette and grayscale images of up to 8 bits per pixel
+  // through a lookup table; 16-bit images aren't supported
+  int use_lut = png->color_type == PNG_INDEXED || (png->color_type == PNG_GREYSCALE && png->depth <= 8);
+  if (!use_lut && !(png->depth == 8 && (png->color_type == PNG_TRUECOLOR ||
+                                        png->color_type == PNG_TRUECOLOR_ALPHA ||
+                                        png->color_type == PNG_GREYSCALE_ALPHA))) {
+    png_close_file(png);
     return IMG_ERR_NOT_TRUECOLOR;
   }
 
-  unsigned num_pixels = png.width * png.height;
+  // clip the region to the image
+  int64_t x0 = 0, y0 = 0, x1 = png->width, y1 = png->height;
+  if (roi != NULL) {
+    if (roi->x > x0) x0 = roi->x;
+    if (roi->y > y0) y0 = roi->y;
+    if ((int64_t) roi->x + roi->width < x1) x1 = (int64_t) roi->x + roi->width;
+    if ((int64_t) roi->y + roi->height < y1) y1 = (int64_t) roi->y + roi->height;
+    if (x0 >= x1 || y0 >= y1) {
+      png_close_file(png);
+      return IMG_ERR_EMPTY_REGION;
+    }
+  }
+
+  uint64_t num_pixels = (uint64_t) (x1 - x0) * (y1 - y0);
+  if (num_pixels > SIZE_MAX / sizeof(uint32_t)) {
+    png_close_file(png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
   // allocate buffer for pixel data in truecolor RGBA format
   uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    png_close_file(png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  // the rows are converted into the pixel buffer as they are decoded,
+  // so no buffer for the whole PNG data is needed
+  struct DecodeTarget target = {
+    .png = png,
+    .pixels = pixel_data,
+    .x0 = (uint32_t) x0,
+    .y0 = (uint32_t) y0,
+    .y1 = (uint32_t) y1,
+    .width = (uint32_t) (x1 - x0),
+    .bpp = png->bpp,
+    .lut_depth = use_lut ? png->depth : 0,
+    .lut_ready = 0,
+  };
+  if (png_get_rows(png, convert_row, &target) != PNG_NO_ERROR) {
+    png_close_file(png);
+    free(pixel_data);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  // communicate pixel data and image dimensions to caller
+  img->data = pixel_data;
+  img->width = (uint32_t) (x1 - x0);
+  img->height = (uint32_t) (y1 - y0);
+  img->dirty = NULL;
+  img->mapped_len = 0;
 
-    for (unsigned i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+  png_close_file(png);
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
-    }
+  return IMG_SUCCESS;
+}
 
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+// Read the pixels of the region of a PNG file given by roi, or of
+// the whole image if roi is NULL.
+static int read_png(const char *filename, const struct Rect *roi, struct Image *img) {
+  pthread_once(&png_init_once, init_pnglite);
 
-    if (is_little_endian()) {
-      for (unsigned i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
-    }
+  // the file is mapped into memory, and its IDAT chunks are inflated
+  // where they are instead of being read and copied chunk by chunk
+  png_t png;
+  if (png_open_file_mmap(&png, filename) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
   }
+  return decode_png(&png, roi, img);
+}
 
-  // communicate pixel data and image dimensions to caller
-  img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+int read_image(const char *filename, struct Image *img) {
+  // an image decoded before is mapped from the cache (if enabled)
+  struct ImageCacheKey key;
+  if (image_cache_lookup(filename, img, &key)) {
+    return IMG_SUCCESS;
+  }
+
+  int rc = read_png(filename, NULL, img);
+  if (rc == IMG_SUCCESS) {
+    image_cache_store(&key, img);
+  }
+  return rc;
+}
 
-  png_close_file(&png);
+void free_image(struct Image *img) {
+  if (img->mapped_len != 0) {
+    image_cache_unmap(img);
+  } else {
+    free(img->data);
+  }
+  img->data = NULL;
+  img->mapped_len = 0;
+  image_untrack_dirty(img);
+}
 
-  return IMG_SUCCESS;
+int read_image_region(const char *filename, const struct Rect *roi, struct Image *img) {
+  return read_png(filename, roi, img);
 }
 
-int write_image(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int read_image_from_memory(const void *buf, size_t len, struct Image *img) {
+  pthread_once(&png_init_once, init_pnglite);
+
+  // the chunks are parsed, and the image data inflated, where they
+  // are in the buffer
+  png_t png;
+  if (png_open_memory(&png, buf, len) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
   }
+  return decode_png(&png, NULL, img);
+}
 
+struct ImageWriter {
   png_t png;
+  uint32_t width, height;
+  uint32_t rows_written;
+  uint32_t *row;   // one row converted to big-endian order
+  int failed;
+};
+
+void init_write_options(struct ImageWriteOptions *opts) {
+  opts->level = IMG_LEVEL_DEFAULT;
+  opts->strategy = IMG_STRATEGY_DEFAULT;
+  opts->window_bits = 15;
+  opts->mem_level = 8;
+  opts->threads = 1;
+}
+
+// the IMG_LEVEL_* and IMG_STRATEGY_* values are zlib's, and are
+// passed to pnglite as they are
+static int valid_write_options(const struct ImageWriteOptions *opts) {
+  return opts->level >= IMG_LEVEL_DEFAULT && opts->level <= IMG_LEVEL_SMALLEST &&
+         opts->strategy >= IMG_STRATEGY_DEFAULT && opts->strategy <= IMG_STRATEGY_FIXED &&
+         opts->window_bits >= 9 && opts->window_bits <= 15 &&
+         opts->mem_level >= 1 && opts->mem_level <= 9 && opts->threads >= 1;
+}
+
+int open_image_writer(const char *filename, uint32_t width, uint32_t height, struct ImageWriter **writer) {
+  return open_image_writer_ex(filename, width, height, NULL, writer);
+}
+
+int open_image_writer_ex(const char *filename, uint32_t width, uint32_t height,
+                         const struct ImageWriteOptions *opts, struct ImageWriter **writer) {
+  pthread_once(&png_init_once, init_pnglite);
+
+  // the options are checked before the file is created
+  struct ImageWriteOptions defaults;
+  if (opts == NULL) {
+    init_write_options(&defaults);
+    opts = &defaults;
+  }
+  if (!valid_write_options(opts)) {
+    return IMG_ERR_INVALID_OPTIONS;
+  }
+
+  struct ImageWriter *w = (struct ImageWriter *) calloc(1, sizeof(struct ImageWriter));
+  if (w == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  w->width = width;
+  w->height = height;
+  w->row = (uint32_t *) malloc(((uint64_t) width + 1) * sizeof(uint32_t));
+  if (w->row == NULL) {
+    free(w);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
+  if (png_open_file_write(&w->png, filename) != PNG_NO_ERROR) {
+    free(w->row);
+    free(w);
     return IMG_ERR_COULD_NOT_OPEN;
   }
+  png_write_set_filter(&w->png, write_filter);
+  png_write_set_compression(&w->png, opts->level, opts->strategy, opts->window_bits, opts->mem_level);
+  png_write_set_threads(&w->png, (unsigned) opts->threads);
+  int rc = png_write_begin(&w->png, width, height, 8, PNG_TRUECOLOR_ALPHA);
+  if (rc != PNG_NO_ERROR) {
+    png_close_file(&w->png);
+    free(w->row);
+    free(w);
+    return rc == PNG_MEMORY_ERROR ? IMG_ERR_MALLOC_FAILED : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  *writer = w;
+  return IMG_SUCCESS;
+}
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+int write_image_rows(struct ImageWriter *writer, const uint32_t *rows, uint32_t num_rows) {
+  if (writer->failed || num_rows > writer->height - writer->rows_written) {
+    writer->failed = 1;
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
 
-  uint32_t *data_to_write = img->data;
+  // PNG requires big-endian pixels, so rows are converted one
+  // at a time (on a big endian system they're written directly)
   int need_byteswap = is_little_endian();
+  for (uint32_t j = 0; j < num_rows; j++) {
+    const uint32_t *src = rows + (uint64_t) j * writer->width;
+    unsigned char *row = (unsigned char *) src;
+    if (need_byteswap) {
+      for (uint32_t i = 0; i < writer->width; i++) {
+        writer->row[i] = byteswap(src[i]);
+      }
+      row = (unsigned char *) writer->row;
+    }
+    if (png_write_rows(&writer->png, row, 1) != PNG_NO_ERROR) {
+      writer->failed = 1;
+      return IMG_ERR_COULD_NOT_WRITE;
+    }
+    writer->rows_written++;
+  }
+  return IMG_SUCCESS;
+}
+
+int close_image_writer(struct ImageWriter *writer) {
+  int success = !writer->failed && writer->rows_written == writer->height;
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
+  // the stream is finished (and its memory freed) even on failure
+  if (png_write_end(&writer->png) != PNG_NO_ERROR) {
+    success = 0;
+  }
+  if (ferror((FILE *) writer->png.user_pointer)) {
+    success = 0;
+  }
+  png_close_file(&writer->png);
+  free(writer->row);
+  free(writer);
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int write_image(const char *filename, struct Image *img) {
+  return write_image_ex(filename, img, NULL);
+}
+
+int write_image_ex(const char *filename, struct Image *img, const struct ImageWriteOptions *opts) {
+  // the rows are converted and compressed one at a time, so no
+  // copy of the whole image is needed
+  struct ImageWriter *writer;
+  int rc = open_image_writer_ex(filename, img->width, img->height, opts, &writer);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  rc = write_image_rows(writer, img->data, img->height);
+  int close_rc = close_image_writer(writer);
+  return rc != IMG_SUCCESS ? rc : close_rc;
+}
+
+int image_track_dirty(struct Image *img) {
+  if (img->dirty == NULL) {
+    img->dirty = (struct DirtyRegion *) malloc(sizeof(struct DirtyRegion));
+    if (img->dirty == NULL) {
       return IMG_ERR_MALLOC_FAILED;
     }
+    img->dirty->num_rects = 0;
+  }
+  return IMG_SUCCESS;
+}
 
-    uint32_t num_pixels = img->width * img->height;
-    for (uint32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
-    }
+void image_untrack_dirty(struct Image *img) {
+  free(img->dirty);
+  img->dirty = NULL;
+}
+
+static int dirty_rects_overlap(const struct DirtyRect *a, const struct DirtyRect *b) {
+  return a->x < b->x + b->width && b->x < a->x + a->width &&
+         a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static int dirty_rect_contains(const struct DirtyRect *outer, const struct DirtyRect *inner) {
+  return inner->x >= outer->x && inner->y >= outer->y &&
+         inner->x + inner->width <= outer->x + outer->width &&
+         inner->y + inner->height <= outer->y + outer->height;
+}
+
+static struct DirtyRect dirty_rect_union(const struct DirtyRect *a, const struct DirtyRect *b) {
+  uint32_t x0 = a->x < b->x ? a->x : b->x;
+  uint32_t y0 = a->y < b->y ? a->y : b->y;
+  uint32_t x1 = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+  uint32_t y1 = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+  return (struct DirtyRect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+void image_mark_dirty(struct Image *img, int64_t x, int64_t y, int64_t width, int64_t height) {
+  struct DirtyRegion *region = img->dirty;
+  if (region == NULL) {
+    return;
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+  // clip to the image
+  int64_t x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+  int64_t x1 = x + width, y1 = y + height;
+  if (x1 > img->width) x1 = img->width;
+  if (y1 > img->height) y1 = img->height;
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  struct DirtyRect rect = { (uint32_t) x0, (uint32_t) y0, (uint32_t) (x1 - x0), (uint32_t) (y1 - y0) };
+
+  for (;;) {
+    // absorb every rectangle the new one overlaps; the union may
+    // overlap rectangles that were already checked, so start over
+    // whenever it grows
+    unsigned i = 0;
+    while (i < region->num_rects) {
+      struct DirtyRect *r = &region->rects[i];
+      if (!dirty_rects_overlap(r, &rect)) {
+        i++;
+      } else if (dirty_rect_contains(r, &rect)) {
+        return;
+      } else {
+        rect = dirty_rect_union(r, &rect);
+        *r = region->rects[--region->num_rects];
+        i = 0;
+      }
+    }
+    if (region->num_rects < DIRTY_MAX_RECTS) {
+      region->rects[region->num_rects++] = rect;
+      return;
+    }
+
+    // the region is full: merge with the rectangle whose union with
+    // the new one adds the least area, and check for overlaps again
+    unsigned best = 0;
+    uint64_t best_growth = UINT64_MAX;
+    for (i = 0; i < region->num_rects; i++) {
+      struct DirtyRect u = dirty_rect_union(&region->rects[i], &rect);
+      uint64_t growth = (uint64_t) u.width * u.height -
+                        (uint64_t) region->rects[i].width * region->rects[i].height;
+      if (growth < best_growth) {
+        best = i;
+        best_growth = growth;
+      }
+    }
+    rect = dirty_rect_union(&region->rects[best], &rect);
+    region->rects[best] = region->rects[--region->num_rects];
+  }
+}
 
-  png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+unsigned image_get_dirty(const struct Image *img, const struct DirtyRect **rects) {
+  if (img->dirty == NULL) {
+    *rects = NULL;
+    return 0;
   }
+  *rects = img->dirty->rects;
+  return img->dirty->num_rects;
+}
 
-  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+void image_reset_dirty(struct Image *img) {
+  if (img->dirty != NULL) {
+    img->dirty->num_rects = 0;
+  }
 }
@@ -1,12 +1,31 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+// maximum number of rectangles kept in a dirty region; further
+// rectangles are merged into the existing ones
+#define DIRTY_MAX_RECTS 32
+
+// A rectangle of modified pixels, clipped to the image.
+struct DirtyRect {
+  uint32_t x, y, width, height;
+};
+
+// The set of regions of an image modified since tracking started
+// or was last reset. The rectangles never overlap each other.
+struct DirtyRegion {
+  unsigned num_rects;
+  struct DirtyRect rects[DIRTY_MAX_RECTS];
+};
+
 struct Image {
   uint32_t width;
   uint32_t height;
   uint32_t *data;
+  struct DirtyRegion *dirty; // NULL unless dirty tracking is enabled
+  uint64_t mapped_len;       // nonzero if data is mapped from the image cache
 };
 
 // return values from init_image, read_image, and write_image
@@ -15,6 +34,11 @@ struct Image {
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_EMPTY_REGION     -5
+#define IMG_ERR_INVALID_OPTIONS  -6
+
+// a rectangle of pixels (defined in drawing_funcs.h)
+struct Rect;
 
 // Initialize an Image struct instance by creating a pixel
 // buffer large enough to accommodate an image of the specified
@@ -34,7 +58,12 @@ struct Image {
 int init_image(struct Image *img, uint32_t width, uint32_t height);
 
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. Several threads may read (or write)
+// different images at the same time. 8-bit truecolor (RGB or RGBA)
+// and gray and alpha images, and palette (with transparency) and
+// grayscale images of up to 8 bits per pixel, are supported; they
+// are all converted to RGBA. 16-bit images give
+// IMG_ERR_NOT_TRUECOLOR.
 //
 // Parameters:
 //   filename - name of PNG file to read
@@ -46,8 +75,134 @@ int init_image(struct Image *img, uint32_t width, uint32_t height);
 //   IMG_ERR_* values
 int read_image(const char *filename, struct Image *img);
 
+// Read one rectangular region of a PNG image from a file and
+// initialize the specified Image struct instance with just the
+// pixels of the region. The rows below the region are not
+// decompressed (nor even read from the file), and only the pixels
+// of the region are converted and stored, so reading a small part of
+// a large image is much cheaper than reading all of it.
+//
+// Parameters:
+//   filename - name of PNG file to read
+//   roi      - the region to read, which is clipped to the image
+//   img      - pointer to Image struct to initialize with the
+//              region's pixels (the region's upper left corner
+//              becomes the image's upper left corner)
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_EMPTY_REGION if the region
+//   doesn't overlap the image, otherwise one of the other
+//   IMG_ERR_* values
+int read_image_region(const char *filename, const struct Rect *roi, struct Image *img);
+
+// how the checksums of PNG files are handled by read_image (see
+// image_set_crc_policy)
+#define IMG_CRC_VERIFY      0
+#define IMG_CRC_SKIP        1
+#define IMG_CRC_BACKGROUND  2
+
+// Select how read_image handles the checksums (CRCs) stored in PNG
+// files. IMG_CRC_VERIFY checks the image data as it is read (the
+// default). IMG_CRC_SKIP doesn't check it, which saves a pass over
+// the data of files that are known to be intact. IMG_CRC_BACKGROUND
+// checks it in a separate thread while the image is being decoded.
+// Must not be called while other threads are reading images.
+//
+// Parameters:
+//   policy - IMG_CRC_VERIFY, IMG_CRC_SKIP or IMG_CRC_BACKGROUND
+void image_set_crc_policy(int policy);
+
+// Decode a PNG image held in memory (such as a file's contents
+// received over the network) and initialize the specified Image
+// struct instance, as read_image does for a file. The buffer is
+// parsed and decompressed in place: it isn't copied, and nothing is
+// written to the filesystem. The image cache isn't used.
+//
+// Parameters:
+//   buf - the PNG data
+//   len - length of the PNG data in bytes
+//   img - pointer to Image struct to initialize with the decoded
+//         image data
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int read_image_from_memory(const void *buf, size_t len, struct Image *img);
+
+// Free the pixel data and dirty region of an image. Images read
+// while the image cache is enabled must be freed this way, since
+// their pixels may be mapped from the cache rather than allocated.
+//
+// Parameters:
+//   img - pointer to Image struct
+void free_image(struct Image *img);
+
+// statistics of the image cache (see image_cache_enable)
+struct ImageCacheStats {
+  unsigned hits;          // images mapped from the cache
+  unsigned misses;        // images decoded because they weren't cached
+  unsigned stores;        // decoded images written to the cache
+  unsigned evictions;     // cached images deleted to stay under the limit
+  uint64_t evicted_bytes;
+};
+
+// Enable a cache of decoded images kept on disk: read_image then
+// maps the pixels of a PNG file it has decoded before (in this or
+// an earlier run) from the cache instead of decoding the file
+// again. Cached images are identified by the file (device and
+// inode), its size and its modification time, so a changed file is
+// decoded again. Once the cache files take more than max_bytes, the
+// least recently used ones are deleted. The cache files hold pixels
+// in the host's byte order, so a cache directory shouldn't be shared
+// between different kinds of machines.
+//
+// Parameters:
+//   dir       - directory holding the cache (created if needed)
+//   max_bytes - maximum total size of the cache files
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_OPEN if the
+//   directory can't be used, or IMG_ERR_MALLOC_FAILED
+int image_cache_enable(const char *dir, uint64_t max_bytes);
+
+// Disable the image cache (images already read from it stay valid).
+void image_cache_disable(void);
+
+// Get the statistics of the image cache since the program started.
+//
+// Parameters:
+//   stats - receives the statistics
+void image_cache_get_stats(struct ImageCacheStats *stats);
+
+// How the rows of written PNG files are filtered before they are
+// compressed (see image_set_write_filter)
+#define IMG_FILTER_ADAPTIVE (-1)
+#define IMG_FILTER_NONE     0
+#define IMG_FILTER_SUB      1
+#define IMG_FILTER_UP       2
+#define IMG_FILTER_AVERAGE  3
+#define IMG_FILTER_PAETH    4
+
+// Select how write_image and write_image_rows filter each row of a
+// PNG file, which makes its bytes easier to compress.
+// IMG_FILTER_ADAPTIVE (the default) picks the filter that gives
+// each row the smallest bytes, which makes most images much smaller
+// than IMG_FILTER_NONE, at some cost in speed. The other values use
+// the same filter for every row. Must not be called while other
+// threads are writing images.
+//
+// Parameters:
+//   filter - IMG_FILTER_ADAPTIVE or one of the other IMG_FILTER_*
+//            values
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_WRITE if the
+//   filter is unknown
+int image_set_write_filter(int filter);
+
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file. Several threads may write (or read)
+// different images at the same time.
 //
 // Parameters:
 //   filename - name of PNG file to write
@@ -59,4 +214,156 @@ int read_image(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int write_image(const char *filename, struct Image *img);
 
+// compression levels (any level from 0 to 9 may be used)
+#define IMG_LEVEL_DEFAULT   (-1)
+#define IMG_LEVEL_NONE      0
+#define IMG_LEVEL_FASTEST   1
+#define IMG_LEVEL_SMALLEST  9
+
+// compression strategies (see zlib's deflateInit2)
+#define IMG_STRATEGY_DEFAULT       0
+#define IMG_STRATEGY_FILTERED      1
+#define IMG_STRATEGY_HUFFMAN_ONLY  2
+#define IMG_STRATEGY_RLE           3
+#define IMG_STRATEGY_FIXED         4
+
+// How the pixel data of a PNG file is compressed. Low levels and
+// IMG_STRATEGY_RLE or IMG_STRATEGY_HUFFMAN_ONLY write quickly (for
+// previews), level 9 writes the smallest files (for archiving).
+// Several threads make large images much faster to write, and the
+// files slightly larger.
+struct ImageWriteOptions {
+  int level;        // IMG_LEVEL_DEFAULT, or 0 to 9
+  int strategy;     // one of the IMG_STRATEGY_* values
+  int window_bits;  // log2 of the compression window, 9 to 15
+  int mem_level;    // compressor memory use, 1 to 9
+  int threads;      // threads compressing bands of rows in parallel
+                    // (1 compresses them as one stream)
+};
+
+// Initialize write options to the settings used by write_image.
+//
+// Parameters:
+//   opts - pointer to ImageWriteOptions
+void init_write_options(struct ImageWriteOptions *opts);
+
+// Write an image to a PNG file, like write_image, with the given
+// compression settings.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   img      - pointer to Image struct with the pixel data to write
+//   opts     - compression settings (NULL for the defaults)
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_INVALID_OPTIONS if a setting
+//   is out of range (the file isn't created), otherwise one of the
+//   IMG_ERR_* values
+int write_image_ex(const char *filename, struct Image *img, const struct ImageWriteOptions *opts);
+
+// A PNG file being written incrementally, a group of rows at a time.
+struct ImageWriter;
+
+// Create a PNG output file and write its header, so that the
+// image's rows can then be written with write_image_rows as they
+// become available. Only a bounded amount of compressed data is
+// buffered, independent of the image size.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   width    - image width
+//   height   - image height
+//   writer   - receives a pointer to the new ImageWriter
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int open_image_writer(const char *filename, uint32_t width, uint32_t height, struct ImageWriter **writer);
+
+// Create a PNG output file like open_image_writer, with the given
+// compression settings.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   width    - image width
+//   height   - image height
+//   opts     - compression settings (NULL for the defaults)
+//   writer   - receives a pointer to the new ImageWriter
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_INVALID_OPTIONS if a setting
+//   is out of range, otherwise one of the IMG_ERR_* values
+int open_image_writer_ex(const char *filename, uint32_t width, uint32_t height,
+                         const struct ImageWriteOptions *opts, struct ImageWriter **writer);
+
+// Compress and write the next rows of the image, in top to bottom
+// order.
+//
+// Parameters:
+//   writer   - pointer to ImageWriter
+//   rows     - pixel data of the rows (width pixels per row)
+//   num_rows - number of rows
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values (the writer must still be closed)
+int write_image_rows(struct ImageWriter *writer, const uint32_t *rows, uint32_t num_rows);
+
+// Finish the PNG file, close it, and free the writer. All of the
+// image's rows must have been written.
+//
+// Parameters:
+//   writer - pointer to ImageWriter
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int close_image_writer(struct ImageWriter *writer);
+
+// Start recording the regions of an image modified by the drawing
+// functions. The region is initially empty. Calling this function
+// when tracking is already enabled has no effect.
+//
+// Parameters:
+//   img - pointer to Image struct
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_MALLOC_FAILED
+int image_track_dirty(struct Image *img);
+
+// Stop recording modified regions, and free the dirty region.
+//
+// Parameters:
+//   img - pointer to Image struct
+void image_untrack_dirty(struct Image *img);
+
+// Add a rectangle to an image's dirty region. The rectangle is
+// clipped to the image, and merged with the rectangles it overlaps.
+// Does nothing if tracking is not enabled.
+//
+// Parameters:
+//   img    - pointer to Image struct
+//   x      - x coordinate of the rectangle's upper left corner
+//   y      - y coordinate of the rectangle's upper left corner
+//   width  - rectangle width
+//   height - rectangle height
+void image_mark_dirty(struct Image *img, int64_t x, int64_t y, int64_t width, int64_t height);
+
+// Get the rectangles in an image's dirty region.
+//
+// Parameters:
+//   img   - pointer to Image struct
+//   rects - receives a pointer to the array of rectangles (valid
+//           until the region is next modified)
+//
+// Returns:
+//   the number of rectangles (0 if tracking is not enabled)
+unsigned image_get_dirty(const struct Image *img, const struct DirtyRect **rects);
+
+// Empty an image's dirty region (tracking stays enabled).
+//
+// Parameters:
+//   img - pointer to Image struct
+void image_reset_dirty(struct Image *img);
+
 #endif
@@ -0,0 +1,302 @@
+/*
+ * Implementation of the on-disk cache of decoded images used by
+ * read_image. Each cached image is a file holding a header and the
+ * image's RGBA pixels in host byte order, which is mapped into memory
+ * instead of decoding the PNG file again.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image_cache.h"
+
+// identifies a cache file (and the byte order of its pixels)
+#define CACHE_MAGIC      "CSFRGBA1"
+#define CACHE_BYTE_ORDER 0x01020304U
+
+// suffix of the cache files (other files in the directory are left
+// alone)
+#define CACHE_SUFFIX ".rgba"
+
+// header at the start of each cache file, followed by the pixels
+struct CacheHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t width, height;
+  uint32_t reserved;
+  struct ImageCacheKey key;
+};
+
+// the cache settings and statistics are shared by all threads
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir = NULL;
+static uint64_t cache_max_bytes;
+static struct ImageCacheStats cache_stats;
+
+int image_cache_enable(const char *dir, uint64_t max_bytes) {
+  struct stat st;
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || access(dir, R_OK | W_OK | X_OK) != 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  char *copy = strdup(dir);
+  if (copy == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  pthread_mutex_lock(&cache_lock);
+  free(cache_dir);
+  cache_dir = copy;
+  cache_max_bytes = max_bytes;
+  pthread_mutex_unlock(&cache_lock);
+  return IMG_SUCCESS;
+}
+
+void image_cache_disable(void) {
+  pthread_mutex_lock(&cache_lock);
+  free(cache_dir);
+  cache_dir = NULL;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void image_cache_get_stats(struct ImageCacheStats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  *stats = cache_stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Get the name of the cache file of a key, which is a hash (64-bit
+// FNV-1a) of the key; the key stored in the file's header guards
+// against collisions.
+// Returns 0 if successful, -1 if the cache is disabled.
+static int cache_path(const struct ImageCacheKey *key, char *path, size_t len) {
+  const unsigned char *bytes = (const unsigned char *) key;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < sizeof(*key); i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  int rc = -1;
+  if (cache_dir != NULL) {
+    snprintf(path, len, "%s/%016llx" CACHE_SUFFIX, cache_dir, (unsigned long long) hash);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return rc;
+}
+
+static void count(unsigned *counter) {
+  pthread_mutex_lock(&cache_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int image_cache_lookup(const char *filename, struct Image *img, struct ImageCacheKey *key) {
+  struct stat st;
+  char path[4096];
+
+  memset(key, 0, sizeof(*key));
+  pthread_mutex_lock(&cache_lock);
+  int enabled = cache_dir != NULL;
+  pthread_mutex_unlock(&cache_lock);
+  if (!enabled || stat(filename, &st) != 0) {
+    return 0;
+  }
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  key->size = st.st_size;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  if (cache_path(key, path, sizeof(path)) != 0) {
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    count(&cache_stats.misses);
+    return 0;
+  }
+
+  // the pixels are mapped copy-on-write, so the image can be drawn on
+  // like a decoded one without modifying the cache
+  void *map = MAP_FAILED;
+  uint64_t len = 0;
+  if (fstat(fd, &st) == 0 && (uint64_t) st.st_size > sizeof(struct CacheHeader) &&
+      (uint64_t) st.st_size <= SIZE_MAX) {
+    len = (uint64_t) st.st_size;
+    map = mmap(NULL, (size_t) len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+
+  const struct CacheHeader *header = map;
+  if (map == MAP_FAILED || memcmp(header->magic, CACHE_MAGIC, 8) != 0 ||
+      header->byte_order != CACHE_BYTE_ORDER || memcmp(&header->key, key, sizeof(*key)) != 0 ||
+      len != sizeof(struct CacheHeader) + (uint64_t) header->width * header->height * sizeof(uint32_t)) {
+    // a collision or a damaged file: the image is decoded and stored again
+    if (map != MAP_FAILED) {
+      munmap(map, (size_t) len);
+    }
+    close(fd);
+    count(&cache_stats.misses);
+    return 0;
+  }
+
+  // the modification time of a cache file records when it was last
+  // used, for eviction
+  futimens(fd, NULL);
+  close(fd);
+
+  img->width = header->width;
+  img->height = header->height;
+  img->data = (uint32_t *) ((char *) map + sizeof(struct CacheHeader));
+  img->dirty = NULL;
+  img->mapped_len = len;
+  count(&cache_stats.hits);
+  return 1;
+}
+
+void image_cache_unmap(struct Image *img) {
+  munmap((char *) img->data - sizeof(struct CacheHeader), (size_t) img->mapped_len);
+}
+
+// Write the whole buffer to a file descriptor.
+// Returns 0 if successful, -1 otherwise.
+static int write_all(int fd, const void *buf, uint64_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len > (1u << 30) ? (1u << 30) : (size_t) len);
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= (uint64_t) n;
+  }
+  return 0;
+}
+
+// a cache file found while evicting
+struct CacheEntry {
+  char name[64];
+  uint64_t size;
+  struct timespec last_used;
+};
+
+static int compare_last_used(const void *a, const void *b) {
+  const struct timespec *ta = &((const struct CacheEntry *) a)->last_used;
+  const struct timespec *tb = &((const struct CacheEntry *) b)->last_used;
+  if (ta->tv_sec != tb->tv_sec) {
+    return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  }
+  return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+// Delete the least recently used cache files until the files take
+// at most cache_max_bytes. The file just stored, named keep, is
+// never deleted (file times may be too coarse to tell it apart from
+// the files used just before it). Must be called with cache_lock
+// held.
+static void evict(const char *keep) {
+  DIR *dir = opendir(cache_dir);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct CacheEntry *entries = NULL;
+  size_t num_entries = 0, capacity = 0;
+  uint64_t total = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    struct stat st;
+    if (len <= strlen(CACHE_SUFFIX) || len >= sizeof(entries->name) ||
+        strcmp(ent->d_name + len - strlen(CACHE_SUFFIX), CACHE_SUFFIX) != 0 ||
+        fstatat(dirfd(dir), ent->d_name, &st, 0) != 0) {
+      continue;
+    }
+    if (num_entries == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct CacheEntry *grown = realloc(entries, capacity * sizeof(struct CacheEntry));
+      if (grown == NULL) {
+        break;
+      }
+      entries = grown;
+    }
+    strcpy(entries[num_entries].name, ent->d_name);
+    entries[num_entries].size = (uint64_t) st.st_size;
+    entries[num_entries].last_used = st.st_mtim;
+    num_entries++;
+    total += (uint64_t) st.st_size;
+  }
+
+  if (total > cache_max_bytes) {
+    qsort(entries, num_entries, sizeof(struct CacheEntry), compare_last_used);
+    for (size_t i = 0; i < num_entries && total > cache_max_bytes; i++) {
+      // images still mapped by a reader stay valid after the unlink
+      if (strcmp(entries[i].name, keep) != 0 && unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+        total -= entries[i].size;
+        cache_stats.evictions++;
+        cache_stats.evicted_bytes += entries[i].size;
+      }
+    }
+  }
+
+  free(entries);
+  closedir(dir);
+}
+
+void image_cache_store(const struct ImageCacheKey *key, const struct Image *img) {
+  char path[4096], tmp_path[4096];
+  uint64_t pixel_bytes = (uint64_t) img->width * img->height * sizeof(uint32_t);
+
+  if (cache_path(key, path, sizeof(path)) != 0) {
+    return;
+  }
+  pthread_mutex_lock(&cache_lock);
+  int fits = sizeof(struct CacheHeader) + pixel_bytes <= cache_max_bytes;
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.tmpXXXXXX", cache_dir != NULL ? cache_dir : ".");
+  pthread_mutex_unlock(&cache_lock);
+  if (!fits) {
+    return;
+  }
+
+  // the file is written under a temporary name and renamed once it
+  // is complete, so other readers (and processes) never see a
+  // partial image
+  struct CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, 8);
+  header.byte_order = CACHE_BYTE_ORDER;
+  header.width = img->width;
+  header.height = img->height;
+  header.key = *key;
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    return;
+  }
+  int ok = write_all(fd, &header, sizeof(header)) == 0 && write_all(fd, img->data, pixel_bytes) == 0;
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  cache_stats.stores++;
+  if (cache_dir != NULL) {
+    evict(strrchr(path, '/') + 1);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * Header of the on-disk cache of decoded images used by read_image
+ * (the public functions controlling it are declared in image.h).
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdint.h>
+#include "image.h"
+
+// identifies the exact version of a PNG file: the same file (device
+// and inode) with the same size and modification time
+struct ImageCacheKey {
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+};
+
+// Look up the decoded pixels of a PNG file in the cache, and map
+// them into memory if they are there.
+//
+// Parameters:
+//   filename - name of the PNG file
+//   img      - initialized with the cached image if it is found
+//              (its pixels must be freed with free_image)
+//   key      - receives the file's key, to store the image with
+//              image_cache_store on a miss
+//
+// Returns:
+//   1 if the image was found, 0 if it must be decoded (including
+//   when the cache is disabled, in which case key isn't set)
+int image_cache_lookup(const char *filename, struct Image *img, struct ImageCacheKey *key);
+
+// Store the decoded pixels of a PNG file in the cache, then evict
+// the least recently used images if the cache grew past its limit.
+// Failures are ignored: the image is simply not cached.
+//
+// Parameters:
+//   key - key of the file, from image_cache_lookup
+//   img - the decoded image
+void image_cache_store(const struct ImageCacheKey *key, const struct Image *img);
+
+// Unmap the pixels of an image returned by image_cache_lookup.
+//
+// Parameters:
+//   img - the image
+void image_cache_unmap(struct Image *img);
+
+#endif // IMAGE_CACHE_H
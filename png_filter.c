@@ -0,0 +1,245 @@
+/*
+ * Implementation of the kernels that filter PNG scanlines before
+ * they are compressed, and choose the filter of each scanline, with
+ * SIMD versions chosen at runtime.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "png_filter.h"
+
+#ifdef PNG_UNFILTER_HAVE_X86
+#include <emmintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+////////////////////////////////////////////////////////////////////////
+
+// The scalar kernels start at byte `start`, so that the SIMD kernels
+// can use them for the bytes before and after their vector loops.
+// Unlike unfiltering, filtering only reads the original bytes, so
+// the bytes of a scanline can be done in any order.
+
+static unsigned char paeth_predictor(unsigned char a, unsigned char b, unsigned char c) {
+  int p = (int) a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  } else if (pb <= pc) {
+    return b;
+  } else {
+    return c;
+  }
+}
+
+// Compute the filtered value of byte i of a scanline.
+static inline unsigned char filter_byte(int filter, int bpp, const unsigned char *row,
+                                        const unsigned char *prev, size_t i) {
+  int has_left = i >= (size_t) bpp;
+  unsigned char a = has_left ? row[i - bpp] : 0;
+  unsigned char b = prev[i];
+  unsigned char c = has_left ? prev[i - bpp] : 0;
+
+  switch (filter) {
+  case PNG_FILTER_SUB:
+    return row[i] - a;
+  case PNG_FILTER_UP:
+    return row[i] - b;
+  case PNG_FILTER_AVERAGE:
+    return row[i] - (unsigned char) (((unsigned) a + b) / 2);
+  case PNG_FILTER_PAETH:
+    return row[i] - paeth_predictor(a, b, c);
+  default:
+    return row[i];
+  }
+}
+
+static int filter_from(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+                       unsigned char *out, size_t start, size_t len) {
+  if (filter < PNG_FILTER_NONE || filter > PNG_FILTER_PAETH) {
+    return -1;
+  }
+  for (size_t i = start; i < len; i++) {
+    out[i] = filter_byte(filter, bpp, row, prev, i);
+  }
+  return 0;
+}
+
+int filter_row_scalar(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+                      unsigned char *out, size_t len) {
+  return filter_from(filter, bpp, row, prev, out, 0, len);
+}
+
+// the absolute value of a filtered byte, taken as a signed number
+static inline unsigned cost_of(unsigned char x) {
+  return x < 128 ? x : 256 - x;
+}
+
+static void costs_from(int bpp, const unsigned char *row, const unsigned char *prev,
+                       size_t start, size_t len, uint64_t costs[PNG_NUM_FILTERS]) {
+  for (size_t i = start; i < len; i++) {
+    for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+      costs[filter] += cost_of(filter_byte(filter, bpp, row, prev, i));
+    }
+  }
+}
+
+void filter_costs_scalar(int bpp, const unsigned char *row, const unsigned char *prev, size_t len,
+                         uint64_t costs[PNG_NUM_FILTERS]) {
+  for (int filter = 0; filter < PNG_NUM_FILTERS; filter++) {
+    costs[filter] = 0;
+  }
+  costs_from(bpp, row, prev, 0, len, costs);
+}
+
+#ifdef PNG_UNFILTER_HAVE_X86
+
+////////////////////////////////////////////////////////////////////////
+// SSE2 kernels
+////////////////////////////////////////////////////////////////////////
+
+// The vector loops cover the bytes that have a left neighbor, 16 at a
+// time: x is the bytes being filtered, a the bytes to their left, b
+// the bytes above them and c the bytes above and to the left.
+
+// Average predictor: pavgb rounds up, so the rounding is corrected.
+static inline __m128i average_predict(__m128i a, __m128i b) {
+  __m128i avg = _mm_avg_epu8(a, b);
+  return _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+// Paeth predictor for 8 bytes in 16-bit lanes (see the Paeth
+// unfilter kernel in png_unfilter.c for the distances used).
+static inline __m128i paeth_predict16(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  __m128i use_a = _mm_cmpeq_epi16(pa, smallest);
+  __m128i use_b = _mm_cmpeq_epi16(pb, smallest);
+  __m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+  return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));
+}
+
+static inline __m128i paeth_predict(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = paeth_predict16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                               _mm_unpacklo_epi8(c, zero));
+  __m128i hi = paeth_predict16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                               _mm_unpackhi_epi8(c, zero));
+  return _mm_packus_epi16(lo, hi);
+}
+
+static inline __m128i filter_vector(int filter, __m128i x, __m128i a, __m128i b, __m128i c) {
+  switch (filter) {
+  case PNG_FILTER_SUB:
+    return _mm_sub_epi8(x, a);
+  case PNG_FILTER_UP:
+    return _mm_sub_epi8(x, b);
+  case PNG_FILTER_AVERAGE:
+    return _mm_sub_epi8(x, average_predict(a, b));
+  case PNG_FILTER_PAETH:
+    return _mm_sub_epi8(x, paeth_predict(a, b, c));
+  default:
+    return x;
+  }
+}
+
+int filter_row_sse2(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+                    unsigned char *out, size_t len) {
+  if (filter < PNG_FILTER_NONE || filter > PNG_FILTER_PAETH) {
+    return -1;
+  }
+
+  size_t start = (size_t) bpp < len ? (size_t) bpp : len;
+  filter_from(filter, bpp, row, prev, out, 0, start);
+  size_t i = start;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+    __m128i a = _mm_loadu_si128((const __m128i *) (row + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+    __m128i c = _mm_loadu_si128((const __m128i *) (prev + i - bpp));
+    _mm_storeu_si128((__m128i *) (out + i), filter_vector(filter, x, a, b, c));
+  }
+  return filter_from(filter, bpp, row, prev, out, i, len);
+}
+
+// Add the absolute values of 16 filtered bytes, taken as signed
+// numbers, to the two 64-bit lanes of a sum.
+static inline __m128i add_cost(__m128i sum, __m128i x) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i abs = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+  return _mm_add_epi64(sum, _mm_sad_epu8(abs, zero));
+}
+
+void filter_costs_sse2(int bpp, const unsigned char *row, const unsigned char *prev, size_t len,
+                       uint64_t costs[PNG_NUM_FILTERS]) {
+  __m128i sums[PNG_NUM_FILTERS];
+  for (int filter = 0; filter < PNG_NUM_FILTERS; filter++) {
+    sums[filter] = _mm_setzero_si128();
+    costs[filter] = 0;
+  }
+
+  size_t start = (size_t) bpp < len ? (size_t) bpp : len;
+  costs_from(bpp, row, prev, 0, start, costs);
+  size_t i = start;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+    __m128i a = _mm_loadu_si128((const __m128i *) (row + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+    __m128i c = _mm_loadu_si128((const __m128i *) (prev + i - bpp));
+    sums[PNG_FILTER_NONE] = add_cost(sums[PNG_FILTER_NONE], x);
+    sums[PNG_FILTER_SUB] = add_cost(sums[PNG_FILTER_SUB], _mm_sub_epi8(x, a));
+    sums[PNG_FILTER_UP] = add_cost(sums[PNG_FILTER_UP], _mm_sub_epi8(x, b));
+    sums[PNG_FILTER_AVERAGE] = add_cost(sums[PNG_FILTER_AVERAGE],
+                                        _mm_sub_epi8(x, average_predict(a, b)));
+    sums[PNG_FILTER_PAETH] = add_cost(sums[PNG_FILTER_PAETH],
+                                      _mm_sub_epi8(x, paeth_predict(a, b, c)));
+  }
+  costs_from(bpp, row, prev, i, len, costs);
+
+  for (int filter = 0; filter < PNG_NUM_FILTERS; filter++) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, sums[filter]);
+    costs[filter] += lanes[0] + lanes[1];
+  }
+}
+
+#endif // PNG_UNFILTER_HAVE_X86
+
+int filter_row(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+               unsigned char *out, size_t len) {
+#ifdef PNG_UNFILTER_HAVE_X86
+  return filter_row_sse2(filter, bpp, row, prev, out, len);
+#else
+  return filter_row_scalar(filter, bpp, row, prev, out, len);
+#endif
+}
+
+int choose_filter(int bpp, const unsigned char *row, const unsigned char *prev, size_t len) {
+  uint64_t costs[PNG_NUM_FILTERS];
+#ifdef PNG_UNFILTER_HAVE_X86
+  filter_costs_sse2(bpp, row, prev, len, costs);
+#else
+  filter_costs_scalar(bpp, row, prev, len, costs);
+#endif
+
+  int best = PNG_FILTER_NONE;
+  for (int filter = PNG_FILTER_SUB; filter <= PNG_FILTER_PAETH; filter++) {
+    if (costs[filter] < costs[best]) {
+      best = filter;
+    }
+  }
+  return best;
+}
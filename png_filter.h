@@ -0,0 +1,86 @@
+/*
+ * Header of the kernels that filter PNG scanlines before they are
+ * compressed, and choose the filter of each scanline, with SIMD
+ * versions chosen at runtime.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "png_unfilter.h"
+
+// choose the filter of each scanline with choose_filter, rather than
+// using one of the PNG_FILTER_* types for every scanline
+#define PNG_FILTER_ADAPTIVE (-1)
+
+// number of filter types
+#define PNG_NUM_FILTERS 5
+
+// Apply a filter to a scanline using plain C: the inverse of
+// unfilter_row. Every kernel below produces exactly the same result.
+//
+// Parameters:
+//   filter - filter type (one of the PNG_FILTER_* values)
+//   bpp    - bytes per pixel (the distance to the "left" byte)
+//   row    - the bytes of the scanline
+//   prev   - the previous scanline (all zero for the first scanline
+//            of an image)
+//   out    - receives the filtered bytes
+//   len    - number of bytes in the scanline
+//
+// Returns:
+//   0 if successful, -1 if the filter type is unknown
+int filter_row_scalar(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+                      unsigned char *out, size_t len);
+
+// Compute the cost of each filter for a scanline using plain C: the
+// sum of the absolute values of the filtered bytes, taken as signed
+// numbers. Small costs mean bytes close to zero, which compress well.
+//
+// Parameters:
+//   bpp   - bytes per pixel
+//   row   - the bytes of the scanline
+//   prev  - the previous scanline (all zero for the first scanline)
+//   len   - number of bytes in the scanline
+//   costs - receives the cost of each filter type
+void filter_costs_scalar(int bpp, const unsigned char *row, const unsigned char *prev, size_t len,
+                         uint64_t costs[PNG_NUM_FILTERS]);
+
+#ifdef PNG_UNFILTER_HAVE_X86
+// Apply a filter to a scanline using SSE2 instructions, 16 bytes at a
+// time for any pixel size. Parameters and return value are as for
+// filter_row_scalar.
+int filter_row_sse2(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+                    unsigned char *out, size_t len);
+
+// Compute the cost of each filter for a scanline using SSE2
+// instructions, evaluating all of the filters on 16 bytes at a time.
+// Parameters are as for filter_costs_scalar.
+void filter_costs_sse2(int bpp, const unsigned char *row, const unsigned char *prev, size_t len,
+                       uint64_t costs[PNG_NUM_FILTERS]);
+#endif
+
+// Apply a filter to a scanline with the fastest kernel the processor
+// supports. Parameters and return value are as for filter_row_scalar.
+int filter_row(int filter, int bpp, const unsigned char *row, const unsigned char *prev,
+               unsigned char *out, size_t len);
+
+// Choose the filter for a scanline that gives the smallest cost (see
+// filter_costs_scalar), preferring the lower filter types on ties.
+//
+// Parameters:
+//   bpp  - bytes per pixel
+//   row  - the bytes of the scanline
+//   prev - the previous scanline (all zero for the first scanline)
+//   len  - number of bytes in the scanline
+//
+// Returns:
+//   the chosen filter type
+int choose_filter(int bpp, const unsigned char *row, const unsigned char *prev, size_t len);
+
+#endif // PNG_FILTER_H
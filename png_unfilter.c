@@ -0,0 +1,440 @@
+/*
+ * Implementation of the kernels that reverse the filtering of PNG
+ * scanlines and convert them to RGBA pixels, with SIMD versions
+ * chosen at runtime.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png_unfilter.h"
+
+#ifdef PNG_UNFILTER_HAVE_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+////////////////////////////////////////////////////////////////////////
+
+// The scalar kernels start at byte `start`, so that the SIMD kernels
+// can use them for the bytes left over after their vector loops (all
+// bytes before `start` must already be unfiltered).
+
+static void sub_scalar(int bpp, unsigned char *row, size_t start, size_t len) {
+  for (size_t i = start < (size_t) bpp ? (size_t) bpp : start; i < len; i++) {
+    row[i] += row[i - bpp];
+  }
+}
+
+static void up_scalar(unsigned char *row, const unsigned char *prev, size_t start, size_t len) {
+  if (prev != NULL) {
+    for (size_t i = start; i < len; i++) {
+      row[i] += prev[i];
+    }
+  }
+}
+
+static void average_scalar(int bpp, unsigned char *row, const unsigned char *prev,
+                           size_t start, size_t len) {
+  for (size_t i = start; i < len; i++) {
+    unsigned a = i >= (size_t) bpp ? row[i - bpp] : 0;
+    unsigned b = prev != NULL ? prev[i] : 0;
+    row[i] += (unsigned char) ((a + b) / 2);
+  }
+}
+
+static unsigned char paeth_predictor(unsigned char a, unsigned char b, unsigned char c) {
+  int p = (int) a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  } else if (pb <= pc) {
+    return b;
+  } else {
+    return c;
+  }
+}
+
+static void paeth_scalar(int bpp, unsigned char *row, const unsigned char *prev,
+                         size_t start, size_t len) {
+  for (size_t i = start; i < len; i++) {
+    int has_left = i >= (size_t) bpp;
+    unsigned char a = has_left ? row[i - bpp] : 0;
+    unsigned char b = prev != NULL ? prev[i] : 0;
+    unsigned char c = (has_left && prev != NULL) ? prev[i - bpp] : 0;
+    row[i] += paeth_predictor(a, b, c);
+  }
+}
+
+static int unfilter_from(int filter, int bpp, unsigned char *row, const unsigned char *prev,
+                         size_t start, size_t len) {
+  switch (filter) {
+  case PNG_FILTER_NONE:
+    return 0;
+  case PNG_FILTER_SUB:
+    sub_scalar(bpp, row, start, len);
+    return 0;
+  case PNG_FILTER_UP:
+    up_scalar(row, prev, start, len);
+    return 0;
+  case PNG_FILTER_AVERAGE:
+    average_scalar(bpp, row, prev, start, len);
+    return 0;
+  case PNG_FILTER_PAETH:
+    paeth_scalar(bpp, row, prev, start, len);
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+int unfilter_row_scalar(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len) {
+  return unfilter_from(filter, bpp, row, prev, 0, len);
+}
+
+static void pixels_to_rgba_from(int bpp, const unsigned char *src, uint32_t *dst,
+                                size_t start, size_t num_pixels) {
+  if (bpp == 2) {
+    // gray and alpha
+    for (size_t i = start; i < num_pixels; i++) {
+      uint32_t g = src[i * 2];
+      dst[i] = (g << 24) | (g << 16) | (g << 8) | src[i * 2 + 1];
+    }
+    return;
+  }
+  for (size_t i = start; i < num_pixels; i++) {
+    const unsigned char *p = src + i * bpp;
+    uint32_t a = bpp == 4 ? p[3] : 255;
+    dst[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | a;
+  }
+}
+
+void pixels_to_rgba_scalar(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels) {
+  pixels_to_rgba_from(bpp, src, dst, 0, num_pixels);
+}
+
+void indices_to_rgba(int depth, const unsigned char *src, size_t first, const uint32_t *lut,
+                     uint32_t *dst, size_t num_pixels) {
+  if (depth == 8) {
+    for (size_t i = 0; i < num_pixels; i++) {
+      dst[i] = lut[src[first + i]];
+    }
+    return;
+  }
+
+  // packed pixels, the leftmost one in the most significant bits
+  unsigned mask = (1u << depth) - 1;
+  for (size_t i = 0; i < num_pixels; i++) {
+    size_t bit = (first + i) * depth;
+    unsigned shift = 8 - depth - (unsigned) (bit % 8);
+    dst[i] = lut[(src[bit / 8] >> shift) & mask];
+  }
+}
+
+#ifdef PNG_UNFILTER_HAVE_X86
+
+////////////////////////////////////////////////////////////////////////
+// SSE2 and SSSE3 kernels
+////////////////////////////////////////////////////////////////////////
+
+// Loads and stores of a single 3 or 4 byte pixel (in the low bytes
+// of a vector).
+
+static inline __m128i load4(const unsigned char *p) {
+  int32_t v;
+  memcpy(&v, p, 4);
+  return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4(unsigned char *p, __m128i v) {
+  int32_t x = _mm_cvtsi128_si32(v);
+  memcpy(p, &x, 4);
+}
+
+// (3 byte pixels are assembled in a register: copying them through
+// memory would stall on the partial writes)
+static inline __m128i load3(const unsigned char *p) {
+  return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+static inline void store3(unsigned char *p, __m128i v) {
+  uint32_t x = (uint32_t) _mm_cvtsi128_si32(v);
+  p[0] = (unsigned char) x;
+  p[1] = (unsigned char) (x >> 8);
+  p[2] = (unsigned char) (x >> 16);
+}
+
+static inline __m128i load_pixel(const unsigned char *p, int bpp) {
+  return bpp == 4 ? load4(p) : load3(p);
+}
+
+static inline void store_pixel(unsigned char *p, __m128i v, int bpp) {
+  if (bpp == 4) {
+    store4(p, v);
+  } else {
+    store3(p, v);
+  }
+}
+
+// Up: every byte only depends on the byte above it, so 16 bytes are
+// unfiltered at a time for any pixel size.
+static size_t up_sse2(unsigned char *row, const unsigned char *prev, size_t len) {
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+    _mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+// Sub, 4 bytes per pixel: a prefix sum of the 4 pixels in a vector
+// (two shifted adds) plus the last pixel of the previous vector.
+static size_t sub4_sse2(unsigned char *row, size_t len) {
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, carry);
+    _mm_storeu_si128((__m128i *) (row + i), x);
+    carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  return i;
+}
+
+// Load and store the 4 pixels (12 bytes) handled by one step of the
+// 3 bytes per pixel Sub kernels, without touching the following bytes.
+static inline __m128i load12(const unsigned char *p) {
+  __m128i lo = _mm_loadl_epi64((const __m128i *) p);
+  return _mm_or_si128(lo, _mm_slli_si128(load4(p + 8), 8));
+}
+
+static inline void store12(unsigned char *p, __m128i v) {
+  _mm_storel_epi64((__m128i *) p, v);
+  store4(p + 8, _mm_srli_si128(v, 8));
+}
+
+// Sub, 3 bytes per pixel: as sub4_sse2, with 4 pixels per vector; the
+// last pixel is broadcast with shifts and masks.
+static size_t sub3_sse2(unsigned char *row, size_t len) {
+  const __m128i low3 = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 12 <= len; i += 12) {
+    __m128i x = load12(row + i);
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+    x = _mm_add_epi8(x, carry);
+    store12(row + i, x);
+    carry = _mm_and_si128(_mm_srli_si128(x, 9), low3);
+    carry = _mm_or_si128(carry, _mm_slli_si128(carry, 3));
+    carry = _mm_or_si128(carry, _mm_slli_si128(carry, 6));
+  }
+  return i;
+}
+
+// Average: each pixel depends on the one to its left, so pixels are
+// done one at a time, with the bytes of a pixel in parallel. The
+// rounded-up average from pavgb is corrected to round down.
+static size_t average_sse2(int bpp, unsigned char *row, const unsigned char *prev, size_t len) {
+  const __m128i ones = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + bpp <= len; i += bpp) {
+    __m128i b = load_pixel(prev + i, bpp);
+    __m128i avg = _mm_avg_epu8(a, b);
+    avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), ones));
+    a = _mm_add_epi8(load_pixel(row + i, bpp), avg);
+    store_pixel(row + i, a, bpp);
+  }
+  return i;
+}
+
+// Paeth: one pixel at a time, in 16-bit lanes. With p = a + b - c,
+// |p - a| = |b - c|, |p - b| = |a - c| and |p - c| = |(b - c) + (a - c)|;
+// the predictor is the first of a, b, c whose distance is smallest.
+// ABS16 computes the absolute values of 16-bit lanes.
+#define DEFINE_PAETH_KERNEL(name, attr, ABS16)                                    \
+  attr static size_t name(int bpp, unsigned char *row, const unsigned char *prev, \
+                          size_t len) {                                           \
+    const __m128i zero = _mm_setzero_si128();                                     \
+    __m128i a = zero, c = zero;                                                   \
+    size_t i = 0;                                                                 \
+    for (; i + bpp <= len; i += bpp) {                                            \
+      __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, bpp), zero);             \
+      __m128i pa = _mm_sub_epi16(b, c);                                           \
+      __m128i pb = _mm_sub_epi16(a, c);                                           \
+      __m128i pc = _mm_add_epi16(pa, pb);                                         \
+      pa = ABS16(pa);                                                             \
+      pb = ABS16(pb);                                                             \
+      pc = ABS16(pc);                                                             \
+      __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));                \
+      __m128i use_a = _mm_cmpeq_epi16(pa, smallest);                              \
+      __m128i use_b = _mm_cmpeq_epi16(pb, smallest);                              \
+      __m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b),                     \
+                                     _mm_andnot_si128(use_b, c));                 \
+      nearest = _mm_or_si128(_mm_and_si128(use_a, a),                             \
+                             _mm_andnot_si128(use_a, nearest));                   \
+      __m128i x = _mm_add_epi8(load_pixel(row + i, bpp),                          \
+                               _mm_packus_epi16(nearest, nearest));               \
+      store_pixel(row + i, x, bpp);                                               \
+      a = _mm_unpacklo_epi8(x, zero);                                             \
+      c = b;                                                                      \
+    }                                                                             \
+    return i;                                                                     \
+  }
+
+static inline __m128i abs16_sse2(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+DEFINE_PAETH_KERNEL(paeth_sse2, , abs16_sse2)
+DEFINE_PAETH_KERNEL(paeth_ssse3, __attribute__((target("ssse3"))), _mm_abs_epi16)
+
+// Sub, 3 bytes per pixel, broadcasting the last pixel with a shuffle.
+__attribute__((target("ssse3")))
+static size_t sub3_ssse3(unsigned char *row, size_t len) {
+  const __m128i last_pixel = _mm_setr_epi8(9, 10, 11, 9, 10, 11, 9, 10, 11, 9, 10, 11,
+                                           -1, -1, -1, -1);
+  __m128i carry = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 12 <= len; i += 12) {
+    __m128i x = load12(row + i);
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+    x = _mm_add_epi8(x, carry);
+    store12(row + i, x);
+    carry = _mm_shuffle_epi8(x, last_pixel);
+  }
+  return i;
+}
+
+//
+// Run the vector part of a kernel, then finish the remaining bytes
+// with the scalar kernel. The first scanline (prev == NULL) of the
+// Average and Paeth filters is left to the scalar kernels, since it
+// only occurs once per image.
+//
+static int unfilter_x86(int filter, int bpp, unsigned char *row, const unsigned char *prev,
+                        size_t len, int ssse3) {
+  size_t done = 0;
+  int pixel_kernel = (bpp == 3 || bpp == 4);
+
+  switch (filter) {
+  case PNG_FILTER_SUB:
+    if (bpp == 4) {
+      done = sub4_sse2(row, len);
+    } else if (bpp == 3) {
+      done = ssse3 ? sub3_ssse3(row, len) : sub3_sse2(row, len);
+    }
+    break;
+  case PNG_FILTER_UP:
+    if (prev != NULL) {
+      done = up_sse2(row, prev, len);
+    }
+    break;
+  case PNG_FILTER_AVERAGE:
+    if (pixel_kernel && prev != NULL) {
+      done = average_sse2(bpp, row, prev, len);
+    }
+    break;
+  case PNG_FILTER_PAETH:
+    if (pixel_kernel && prev != NULL) {
+      done = ssse3 ? paeth_ssse3(bpp, row, prev, len) : paeth_sse2(bpp, row, prev, len);
+    }
+    break;
+  default:
+    break;
+  }
+  return unfilter_from(filter, bpp, row, prev, done, len);
+}
+
+int unfilter_row_sse2(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len) {
+  return unfilter_x86(filter, bpp, row, prev, len, 0);
+}
+
+int unfilter_row_ssse3(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len) {
+  return unfilter_x86(filter, bpp, row, prev, len, 1);
+}
+
+void pixels_to_rgba_sse2(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels) {
+  size_t i = 0;
+  if (bpp == 4) {
+    // byteswap each 32-bit lane with shifts and masks
+    const __m128i mid = _mm_set1_epi32(0x0000FF00);
+    for (; i + 4 <= num_pixels; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (src + i * 4));
+      __m128i y = _mm_or_si128(_mm_slli_epi32(x, 24), _mm_srli_epi32(x, 24));
+      y = _mm_or_si128(y, _mm_slli_epi32(_mm_and_si128(x, mid), 8));
+      y = _mm_or_si128(y, _mm_and_si128(_mm_srli_epi32(x, 8), mid));
+      _mm_storeu_si128((__m128i *) (dst + i), y);
+    }
+  }
+  pixels_to_rgba_from(bpp, src, dst, i, num_pixels);
+}
+
+__attribute__((target("ssse3")))
+void pixels_to_rgba_ssse3(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels) {
+  size_t i = 0;
+  if (bpp == 4) {
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 4 <= num_pixels; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (src + i * 4));
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(x, swap));
+    }
+  } else if (bpp == 3) {
+    // spread 4 pixels (12 bytes) into 4 lanes in reverse byte order,
+    // then set the alpha bytes; the 16 byte load reads 4 bytes past
+    // the pixels, so the last pixels are left to the scalar code
+    const __m128i expand = _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+    const __m128i alpha = _mm_set1_epi32(0x000000FF);
+    for (; i * 3 + 16 <= num_pixels * 3; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (src + i * 3));
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_shuffle_epi8(x, expand), alpha));
+    }
+  } else if (bpp == 2) {
+    // spread 4 gray and alpha pairs (8 bytes) into 4 lanes
+    const __m128i expand = _mm_setr_epi8(1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6);
+    for (; i + 4 <= num_pixels; i += 4) {
+      __m128i x = _mm_loadl_epi64((const __m128i *) (src + i * 2));
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(x, expand));
+    }
+  }
+  pixels_to_rgba_from(bpp, src, dst, i, num_pixels);
+}
+
+int unfilter_have_ssse3(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+#endif // PNG_UNFILTER_HAVE_X86
+
+int unfilter_row(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len) {
+#ifdef PNG_UNFILTER_HAVE_X86
+  return unfilter_x86(filter, bpp, row, prev, len, unfilter_have_ssse3());
+#else
+  return unfilter_row_scalar(filter, bpp, row, prev, len);
+#endif
+}
+
+void pixels_to_rgba(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels) {
+#ifdef PNG_UNFILTER_HAVE_X86
+  if (unfilter_have_ssse3()) {
+    pixels_to_rgba_ssse3(bpp, src, dst, num_pixels);
+  } else {
+    pixels_to_rgba_sse2(bpp, src, dst, num_pixels);
+  }
+#else
+  pixels_to_rgba_scalar(bpp, src, dst, num_pixels);
+#endif
+}
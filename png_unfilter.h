@@ -0,0 +1,115 @@
+/*
+ * Header of the kernels that reverse the filtering of PNG scanlines
+ * and convert them to RGBA pixels, with SIMD versions chosen at
+ * runtime.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef PNG_UNFILTER_H
+#define PNG_UNFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// filter types of a PNG scanline
+#define PNG_FILTER_NONE    0
+#define PNG_FILTER_SUB     1
+#define PNG_FILTER_UP      2
+#define PNG_FILTER_AVERAGE 3
+#define PNG_FILTER_PAETH   4
+
+// the SSE2 and SSSE3 kernels are only available on x86
+#if defined(__x86_64__) || defined(__i386__)
+#define PNG_UNFILTER_HAVE_X86 1
+#endif
+
+// Reverse the filter applied to a scanline, in place, using plain C.
+// Every kernel below produces exactly the same result.
+//
+// Parameters:
+//   filter - filter type (one of the PNG_FILTER_* values)
+//   bpp    - bytes per pixel (the distance to the "left" byte)
+//   row    - the filtered bytes of the scanline, which are replaced
+//            by the unfiltered bytes
+//   prev   - the unfiltered previous scanline, or NULL for the first
+//            scanline of an image
+//   len    - number of bytes in the scanline
+//
+// Returns:
+//   0 if successful, -1 if the filter type is unknown
+int unfilter_row_scalar(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len);
+
+#ifdef PNG_UNFILTER_HAVE_X86
+// Reverse the filter applied to a scanline using SSE2 instructions,
+// which every x86-64 processor supports. Rows with 3 or 4 bytes per
+// pixel use specialized kernels; other rows are only vectorized for
+// the Up filter. Parameters and return value are as for
+// unfilter_row_scalar.
+int unfilter_row_sse2(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len);
+
+// Reverse the filter applied to a scanline using SSSE3 instructions.
+// Must only be called if unfilter_have_ssse3 returns nonzero.
+// Parameters and return value are as for unfilter_row_scalar.
+int unfilter_row_ssse3(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len);
+
+// Check whether the processor supports SSSE3.
+//
+// Returns:
+//   nonzero if unfilter_row_ssse3 may be called
+int unfilter_have_ssse3(void);
+#endif
+
+// Reverse the filter applied to a scanline with the fastest kernel
+// the processor supports. Parameters and return value are as for
+// unfilter_row_scalar.
+int unfilter_row(int filter, int bpp, unsigned char *row, const unsigned char *prev, size_t len);
+
+// Convert unfiltered 8-bit RGB, RGBA or gray and alpha pixels (in
+// PNG byte order) to RGBA pixel values, with red in the most
+// significant byte and blue in the least significant byte, as used
+// by struct Image. RGB pixels get an alpha of 255, and gray values
+// are copied to red, green and blue.
+//
+// Parameters:
+//   bpp        - bytes per pixel of the source (2 for gray and
+//                alpha, 3 for RGB or 4 for RGBA)
+//   src        - the source pixels
+//   dst        - receives the converted pixels
+//   num_pixels - number of pixels
+void pixels_to_rgba_scalar(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels);
+
+#ifdef PNG_UNFILTER_HAVE_X86
+// Convert pixels as pixels_to_rgba_scalar, byteswapping RGBA pixels
+// four at a time with SSE2 instructions (the other pixels use the
+// scalar code).
+void pixels_to_rgba_sse2(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels);
+
+// Convert pixels as pixels_to_rgba_scalar, expanding or byteswapping
+// four pixels at a time with SSSE3 shuffles. Must only be called if
+// unfilter_have_ssse3 returns nonzero.
+void pixels_to_rgba_ssse3(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels);
+#endif
+
+// Convert pixels as pixels_to_rgba_scalar, with the fastest kernel
+// the processor supports.
+void pixels_to_rgba(int bpp, const unsigned char *src, uint32_t *dst, size_t num_pixels);
+
+// Convert unfiltered palette indices, or grayscale values, of 1, 2,
+// 4 or 8 bits to RGBA pixel values by looking them up in a table
+// (built from the palette, or from the gray levels, and the
+// transparency information).
+//
+// Parameters:
+//   depth      - bits per pixel of the source (1, 2, 4 or 8)
+//   src        - the source row, with the pixels smaller than a
+//                byte packed from the most significant bit down
+//   first      - index of the first pixel to convert in the row
+//   lut        - RGBA value of each of the 2^depth possible values
+//   dst        - receives the converted pixels
+//   num_pixels - number of pixels
+void indices_to_rgba(int depth, const unsigned char *src, size_t first, const uint32_t *lut,
+                     uint32_t *dst, size_t num_pixels);
+
+#endif // PNG_UNFILTER_H
@@ -1,7 +1,6 @@
 /*  pnglite.c - pnglite library
     For conditions of distribution and use, see copyright notice in pnglite.h
 */
-#define DO_CRC_CHECKS 1
 #define USE_ZLIB 1
 
 #if USE_ZLIB
@@ -13,15 +12,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "pnglite.h"
+#include "png_unfilter.h"
+#include "png_filter.h"
 
-static png_alloc_t png_alloc;
-static png_free_t png_free;
+/* default to the libc allocator, so that pnglite can be used (from any
+   thread) without calling png_init, which is then only needed to
+   install custom routines before any other thread uses the library */
+static png_alloc_t png_alloc = &malloc;
+static png_free_t png_free = &free;
+
+/* how the CRCs of the pngs opened for reading are checked (see png_set_crc_policy) */
+static int png_crc_policy = PNG_CRC_VERIFY;
 
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
 	size_t result;
-	if(png->read_fun)
+	if(png->mem)
+	{
+		/* reading from memory: copy (or skip) the whole elements that are left */
+		size_t left = size ? (png->mem_len - png->mem_pos) / size : 0;
+
+		result = numel < left ? numel : left;
+		if(out)
+			memcpy(out, png->mem + png->mem_pos, result * size);
+		png->mem_pos += result * size;
+	}
+	else if(png->read_fun)
 	{
 		result = png->read_fun(out, size, numel, png->user_pointer);
 	}
@@ -120,6 +143,16 @@ int png_init(png_alloc_t pngalloc, png_free_t pngfree)
 	return PNG_NO_ERROR;
 }
 
+int png_set_crc_policy(int policy)
+{
+	if(policy != PNG_CRC_VERIFY && policy != PNG_CRC_SKIP && policy != PNG_CRC_BACKGROUND)
+		return PNG_WRONG_ARGUMENTS;
+
+	png_crc_policy = policy;
+
+	return PNG_NO_ERROR;
+}
+
 static int png_get_bpp(png_t* png)
 {
 	int bpp;
@@ -140,18 +173,26 @@ static int png_get_bpp(png_t* png)
 		return PNG_FILE_ERROR;
 	}
 
-	bpp *= png->depth/8;
+	/* bytes per complete pixel, rounded up: pixels smaller than a byte are filtered bytewise */
+	bpp = (bpp * png->depth + 7) / 8;
 
 	return bpp;
 }
 
+/* number of bytes of pixel data in a row; only the single channel color types have depths below 8 */
+static size_t png_row_bytes(png_t* png)
+{
+	if(png->depth < 8)
+		return ((size_t)png->width * png->depth + 7) / 8;
+
+	return (size_t)png->width * png->bpp;
+}
+
 static int png_read_ihdr(png_t* png)
 {
 	unsigned length;
-#if DO_CRC_CHECKS
 	unsigned orig_crc;
 	unsigned calc_crc;
-#endif
 	unsigned char ihdr[13+4];		 /* length should be 13, make room for type (IHDR) */
 
 	file_read_ul(png, &length);
@@ -164,17 +205,17 @@ static int png_read_ihdr(png_t* png)
 
 	if(file_read(png, ihdr, 1, 13+4) != 13+4)
 		return PNG_EOF_ERROR;
-#if DO_CRC_CHECKS
 	file_read_ul(png, &orig_crc);
 
-	calc_crc = crc32(0L, 0, 0);
-	calc_crc = crc32(calc_crc, ihdr, 13+4);
+	/* the header is tiny, so it is checked right away even with PNG_CRC_BACKGROUND */
+	if(png->crc_policy != PNG_CRC_SKIP)
+	{
+		calc_crc = crc32(0L, 0, 0);
+		calc_crc = crc32(calc_crc, ihdr, 13+4);
 
-	if(orig_crc != calc_crc)
-		return PNG_CRC_ERROR;
-#else
-	file_read_ul(png);
-#endif
+		if(orig_crc != calc_crc)
+			return PNG_CRC_ERROR;
+	}
 
 	png->width = get_ul(ihdr+4);
 	png->height = get_ul(ihdr+8);
@@ -184,11 +225,26 @@ static int png_read_ihdr(png_t* png)
 	png->filter_method = ihdr[15];
 	png->interlace_method = ihdr[16];
 
-	if(png->color_type == PNG_INDEXED)
-		return PNG_NOT_SUPPORTED;
-
-	if(png->depth != 8 && png->depth != 16)
+	/* the combinations of color type and bit depth allowed by the PNG specification */
+	switch(png->color_type)
+	{
+	case PNG_GREYSCALE:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_INDEXED:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_TRUECOLOR:
+	case PNG_GREYSCALE_ALPHA:
+	case PNG_TRUECOLOR_ALPHA:
+		if(png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	default:
 		return PNG_NOT_SUPPORTED;
+	}
 
 	if(png->interlace_method)
 		return PNG_NOT_SUPPORTED;
@@ -251,17 +307,14 @@ void png_print_info(png_t* png)
 	printf("\tinterlace:\t%s\n",	png->interlace_method?"interlace":"no interlace");
 }
 
-int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+static int png_read_header(png_t* png)
 {
 	char header[8];
 	int result;
 
-	png->read_fun = read_fun;
-	png->write_fun = 0;
-	png->user_pointer = user_pointer;
-
-	if(!read_fun && !user_pointer)
-		return PNG_WRONG_ARGUMENTS;
+	png->crc_policy = png_crc_policy;
+	png->palette_len = 0;
+	png->trns_len = 0;
 
 	if(file_read(png, header, 1, 8) != 8)
 		return PNG_EOF_ERROR;
@@ -276,11 +329,48 @@ int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 	return result;
 }
 
+int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
+{
+	png->read_fun = read_fun;
+	png->write_fun = 0;
+	png->user_pointer = user_pointer;
+	png->mem = NULL;
+
+	if(!read_fun && !user_pointer)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_read_header(png);
+}
+
+int png_open_memory(png_t* png, const void* data, size_t len)
+{
+	png->read_fun = 0;
+	png->write_fun = 0;
+	png->user_pointer = 0;
+	png->mem = data;
+	png->mem_len = len;
+	png->mem_pos = 0;
+	png->mem_mapped = 0;
+
+	if(!data)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_read_header(png);
+}
+
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer)
 {
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->mem = NULL;
+	png->filter_choice = PNG_FILTER_ADAPTIVE;
+	png->deflate_level = Z_DEFAULT_COMPRESSION;
+	png->deflate_strategy = Z_DEFAULT_STRATEGY;
+	png->deflate_window_bits = MAX_WBITS;
+	png->deflate_mem_level = 8;
+	png->deflate_threads = 1;
+	png->bands = NULL;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -313,6 +403,37 @@ int png_open_file_write(png_t *png, const char* filename)
 	return png_open_write(png, 0, fp);
 }
 
+int png_open_file_mmap(png_t *png, const char* filename)
+{
+	struct stat st;
+	void* map;
+	int result;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+		return PNG_FILE_ERROR;
+
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		map = MAP_FAILED;
+	else
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED) /* not a regular file (or empty): read it as a stream */
+		return png_open_file_read(png, filename);
+
+	/* the chunks are walked from start to end */
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	result = png_open_memory(png, map, (size_t)st.st_size);
+	png->mem_mapped = 1;
+
+	if(result != PNG_NO_ERROR)
+		png_close_file(png);
+
+	return result;
+}
+
 int png_open_file(png_t *png, const char* filename)
 {
 	return png_open_file_read(png, filename);
@@ -320,6 +441,14 @@ int png_open_file(png_t *png, const char* filename)
 
 int png_close_file(png_t* png)
 {
+	if(png->mem)
+	{
+		if(png->mem_mapped)
+			munmap((void*)png->mem, png->mem_len);
+		png->mem = NULL;
+		return PNG_NO_ERROR;
+	}
+
 	fclose(png->user_pointer);
 
 	return PNG_NO_ERROR;
@@ -337,7 +466,8 @@ static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 
 	memset(stream, 0, sizeof(z_stream));
 
-	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+	if(deflateInit2(stream, png->deflate_level, Z_DEFLATED, png->deflate_window_bits, png->deflate_mem_level,
+			png->deflate_strategy) != Z_OK)
 		return PNG_ZLIB_ERROR;
 
 	stream->next_in = data;
@@ -371,8 +501,10 @@ static int png_init_inflate(png_t* png)
 		return PNG_ZLIB_ERROR;
 #endif
 
+	/* the first row is inflated into the first half of the row window; zlib counts in 32 bits, so very long rows
+	   are inflated in pieces (see png_inflate) */
 	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
+	stream->avail_out = png->png_datalen / 2 > UINT_MAX ? UINT_MAX : (unsigned)(png->png_datalen / 2);
 
 	return PNG_NO_ERROR;
 }
@@ -417,9 +549,18 @@ static int png_end_inflate(png_t* png)
 	return PNG_NO_ERROR;
 }
 
+static int png_unfilter_row(png_t* png, unsigned char* row, unsigned char* prev_line);
+
+/*
+	Inflate the data of an IDAT chunk into the two-row window in png_data. The filter byte and pixels of each row are
+	inflated into one half of the window; once the row is complete it is unfiltered in place (the row above it is in the
+	other half) and passed to the row callback, and the next row reuses the other half.
+*/
 static int png_inflate(png_t* png, unsigned char* data, int len)
 {
 	int result;
+	size_t rowlen = png_row_bytes(png) + 1;
+	unsigned char extra;
 #if USE_ZLIB
 	z_stream *stream = png->zs;
 #else
@@ -432,16 +573,63 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	stream->next_in = data;
 	stream->avail_in = len;
 
+	while(stream->avail_in != 0)
+	{
+		unsigned char *row = png->png_data + (png->rows_done & 1) * rowlen;
+		int finished = png->rows_done == png->height;
+
+		if(finished)
+		{
+			/* all rows are complete, so only the end of the stream may follow */
+			stream->next_out = &extra;
+			stream->avail_out = 1;
+		}
+		else if(stream->avail_out == 0)
+		{
+			size_t remaining = rowlen - (size_t)(stream->next_out - row);
+			stream->avail_out = remaining > UINT_MAX ? UINT_MAX : (unsigned)remaining;
+		}
+
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
+		if(result != Z_STREAM_END && result != Z_OK)
+		{
+			printf("%s\n", stream->msg);
+			return PNG_ZLIB_ERROR;
+		}
+
+		if(finished)
+		{
+			if(stream->avail_out == 0) /* more data than the image holds */
+				return PNG_ZLIB_ERROR;
+		}
+		else if(stream->next_out == row + rowlen)
+		{
+			unsigned char *prev_line = png->rows_done ? png->png_data + ((png->rows_done - 1) & 1) * rowlen + 1 : 0;
+
+			result = png_unfilter_row(png, row, prev_line);
+			if(result == PNG_NO_ERROR)
+				result = png->row_fun(row + 1, png->rows_done, png->row_user_pointer);
+			if(result == PNG_DONE) /* the callback needs no more rows */
+			{
+				png->rows_done++;
+				png->rows_stopped = 1;
+				return PNG_DONE;
+			}
+			if(result != PNG_NO_ERROR)
+				return result;
+
+			png->rows_done++;
+			stream->next_out = png->png_data + (png->rows_done & 1) * rowlen;
+			stream->avail_out = 0;
+		}
+
+		if(result == Z_STREAM_END)
+			break;
 	}
 
 	if(stream->avail_in != 0)
@@ -475,82 +663,455 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	return result;
 }
 
+/* write an IDAT chunk whose CRC (which covers the chunk type) has already been computed */
+static void png_write_idat_chunk_crc(png_t* png, unsigned char* data, unsigned len, unsigned long crc)
+{
+	file_write_ul(png, len);
+	file_write(png, "IDAT", 1, 4);
+	file_write(png, data, 1, len);
+	file_write_ul(png, crc);
+}
+
+static void png_write_iend(png_t* png)
+{
+	file_write_ul(png, 0);
+	file_write(png, "IEND", 1, 4);
+	file_write_ul(png, crc32(0L, (const unsigned char *)"IEND", 4));
+}
+
+/* bytes of filtered rows in each band compressed on its own thread (see png_write_set_threads) */
+#define PNG_BAND_LEN (512u * 1024)
+
+/* one band of filtered rows, compressed on its own thread into one IDAT chunk */
+struct png_band
+{
+	png_t*				png;			/* compressor settings */
+	const unsigned char*		data;
+	size_t				len;
+	const unsigned char*		dict;			/* the data preceding the band (the end of it is used), or NULL */
+	size_t				dict_len;
+	int				first;			/* whether the band starts the zlib stream */
+	int				last;			/* whether the band ends it */
+	unsigned char*			out;			/* the chunk's data: compressed band, with the zlib header and trailer */
+	size_t				out_len;
+	unsigned long			crc;			/* CRC of the chunk */
+	unsigned long			adler;			/* Adler-32 of the band's data */
+	int				result;
+	pthread_t			thread;
+	int				threaded;		/* whether the band is compressed on its own thread */
+};
+
+/* state of the parallel compressor of a png being written */
+struct png_band_writer
+{
+	unsigned			num_threads;
+	size_t				band_len;		/* bytes of whole rows per band */
+	unsigned char*			buf;			/* filtered rows waiting to be compressed, one band per thread */
+	size_t				buf_len;
+	unsigned char*			dict;			/* the end of the data compressed so far, up to a window */
+	size_t				dict_len;
+	unsigned long			adler;			/* Adler-32 of the data compressed so far */
+	int				started;		/* whether the zlib header has been written */
+	struct png_band*		bands;
+};
+
+/* zlib header of the stream, for the settings of png_write_set_compression (as deflate would write it) */
+static void png_zlib_header(png_t* png, unsigned char* header)
+{
+	int level = png->deflate_level == Z_DEFAULT_COMPRESSION ? 6 : png->deflate_level;
+	unsigned flevel, h;
+
+	if(png->deflate_strategy >= Z_HUFFMAN_ONLY || level < 2)
+		flevel = 0;
+	else if(level < 6)
+		flevel = 1;
+	else if(level == 6)
+		flevel = 2;
+	else
+		flevel = 3;
+
+	h = ((unsigned)(Z_DEFLATED + ((png->deflate_window_bits - 8) << 4)) << 8) | (flevel << 6);
+	h += 31 - h % 31;
+	header[0] = (unsigned char)(h >> 8);
+	header[1] = (unsigned char)h;
+}
+
+/*
+	compress a band as raw deflate data, primed with the end of the preceding data so that the band can refer back
+	to it: the compressed bands then join into one stream. All but the last band end with a sync flush, which aligns
+	them to a byte boundary without ending the stream.
+*/
+static void* png_deflate_band(void* arg)
+{
+	struct png_band* band = arg;
+	png_t* png = band->png;
+	z_stream stream;
+	size_t window = (size_t)1 << png->deflate_window_bits;
+	size_t head = band->first ? 2 : 0;
+	size_t bound;
+	int result;
+
+	band->result = PNG_ZLIB_ERROR;
+	band->out = NULL;
+	band->adler = adler32_z(adler32(0L, Z_NULL, 0), band->data, band->len);
+
+	memset(&stream, 0, sizeof(z_stream));
+	if(deflateInit2(&stream, png->deflate_level, Z_DEFLATED, -png->deflate_window_bits, png->deflate_mem_level,
+			png->deflate_strategy) != Z_OK)
+		return NULL;
+
+	if(band->dict_len > 0)
+	{
+		size_t dict_len = band->dict_len > window ? window : band->dict_len;
+		deflateSetDictionary(&stream, band->dict + band->dict_len - dict_len, (unsigned)dict_len);
+	}
+
+	/* room for the compressed data and its sync flush marker, the zlib header and the trailer */
+	bound = deflateBound(&stream, band->len) + 16;
+	band->out = png_alloc(head + bound + 4);
+	if(!band->out)
+	{
+		deflateEnd(&stream);
+		band->result = PNG_MEMORY_ERROR;
+		return NULL;
+	}
+	if(band->first)
+		png_zlib_header(png, band->out);
+
+	stream.next_in = (unsigned char*)band->data;
+	stream.avail_in = (unsigned)band->len;
+	stream.next_out = band->out + head;
+	stream.avail_out = (unsigned)bound;
+	result = deflate(&stream, band->last ? Z_FINISH : Z_SYNC_FLUSH);
+	band->out_len = head + stream.total_out;
+	deflateEnd(&stream);
+
+	if(band->last ? result != Z_STREAM_END : (result != Z_OK || stream.avail_in != 0))
+		return NULL;
+
+	/* the CRC of the chunk is computed here too, while the data is still in this thread's cache */
+	band->crc = crc32_z(crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)"IDAT", 4), band->out, band->out_len);
+	band->result = PNG_NO_ERROR;
+	return NULL;
+}
+
+/*
+	compress filtered rows in bands on up to num_threads threads, and write each band as an IDAT chunk. bw->dict
+	holds the data compressed before, and the Adler-32 of the whole stream is combined from those of the bands.
+*/
+static int png_deflate_bands(png_t* png, struct png_band_writer* bw, const unsigned char* data, size_t len, int last)
+{
+	unsigned i, num_bands = (unsigned)((len + bw->band_len - 1) / bw->band_len);
+	unsigned char trailer[4];
+	size_t dict_len;
+	int result = PNG_NO_ERROR;
+
+	/* the stream is always finished by a band, even an empty one */
+	if(num_bands == 0 && last)
+		num_bands = 1;
+
+	for(i = 0; i < num_bands; i++)
+	{
+		struct png_band* band = &bw->bands[i];
+		size_t offset = i * bw->band_len;
+
+		band->png = png;
+		band->data = data + offset;
+		band->len = len - offset < bw->band_len ? len - offset : bw->band_len;
+		band->dict = i == 0 ? bw->dict : data;
+		band->dict_len = i == 0 ? bw->dict_len : offset;
+		band->first = i == 0 && !bw->started;
+		band->last = last && i + 1 == num_bands;
+	}
+
+	/* the first band is compressed on this thread (and so is any band whose thread can't be started) */
+	for(i = 1; i < num_bands; i++)
+	{
+		bw->bands[i].threaded = pthread_create(&bw->bands[i].thread, NULL, png_deflate_band, &bw->bands[i]) == 0;
+		if(!bw->bands[i].threaded)
+			png_deflate_band(&bw->bands[i]);
+	}
+	png_deflate_band(&bw->bands[0]);
+	for(i = 1; i < num_bands; i++)
+	{
+		if(bw->bands[i].threaded)
+			pthread_join(bw->bands[i].thread, NULL);
+	}
+
+	/* write the chunks in order */
+	for(i = 0; i < num_bands; i++)
+	{
+		struct png_band* band = &bw->bands[i];
+
+		if(result == PNG_NO_ERROR)
+			result = band->result;
+		if(result == PNG_NO_ERROR)
+		{
+			bw->adler = adler32_combine(bw->adler, band->adler, (z_off_t)band->len);
+			if(band->last)
+			{
+				trailer[0] = (unsigned char)(bw->adler >> 24);
+				trailer[1] = (unsigned char)(bw->adler >> 16);
+				trailer[2] = (unsigned char)(bw->adler >> 8);
+				trailer[3] = (unsigned char)bw->adler;
+				memcpy(band->out + band->out_len, trailer, 4);
+				band->crc = crc32(band->crc, trailer, 4);
+				band->out_len += 4;
+			}
+			png_write_idat_chunk_crc(png, band->out, (unsigned)band->out_len, band->crc);
+		}
+		png_free(band->out);
+	}
+	if(result != PNG_NO_ERROR)
+		return result;
+	bw->started = 1;
+
+	/* keep the end of the data for the next band */
+	dict_len = len < ((size_t)1 << png->deflate_window_bits) ? len : ((size_t)1 << png->deflate_window_bits);
+	if(dict_len > 0)
+	{
+		memmove(bw->dict, data + len - dict_len, dict_len);
+		bw->dict_len = dict_len;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+static void png_free_band_writer(struct png_band_writer* bw)
+{
+	if(!bw)
+		return;
+	png_free(bw->buf);
+	png_free(bw->dict);
+	png_free(bw->bands);
+	png_free(bw);
+}
+
+/* set up the parallel compressor for rows of rowlen bytes (plus their filter type), buffering a band per thread */
+static struct png_band_writer* png_new_band_writer(png_t* png, size_t rowlen, int buffered)
+{
+	struct png_band_writer* bw = png_alloc(sizeof(struct png_band_writer));
+	size_t rows_per_band = PNG_BAND_LEN / (rowlen + 1);
+
+	if(!bw)
+		return NULL;
+	memset(bw, 0, sizeof(struct png_band_writer));
+
+	bw->num_threads = png->deflate_threads;
+	bw->band_len = (rows_per_band > 0 ? rows_per_band : 1) * (rowlen + 1);
+	bw->buf = buffered ? png_alloc(bw->band_len * bw->num_threads) : NULL;
+	bw->dict = png_alloc((size_t)1 << png->deflate_window_bits);
+	bw->bands = png_alloc(bw->num_threads * sizeof(struct png_band));
+	bw->adler = adler32(0L, Z_NULL, 0);
+	if((buffered && !bw->buf) || !bw->dict || !bw->bands)
+	{
+		png_free_band_writer(bw);
+		return NULL;
+	}
+
+	return bw;
+}
+
+/* whether rows of rowlen bytes are compressed in parallel (each band is compressed in one deflate call) */
+static int png_use_bands(png_t* png, size_t rowlen)
+{
+	return png->deflate_threads > 1 && rowlen < (1u << 30);
+}
+
+/* size of the buffer collecting compressed data for one IDAT chunk while streaming */
+#define PNG_STREAM_IDAT_LEN (256u * 1024)
+
+/* feed data to the deflate stream, writing an IDAT chunk whenever the output buffer fills up */
+static int png_stream_deflate(png_t* png, unsigned char* data, size_t len, int flush)
+{
+	z_stream *stream = png->zs;
+	int result;
+
+	do
+	{
+		unsigned piece = len > UINT_MAX ? UINT_MAX : (unsigned)len;
+		stream->next_in = data;
+		stream->avail_in = piece;
+
+		do
+		{
+			unsigned char *out;
+
+			if(stream->avail_out == 0)
+			{
+				png_write_idat_chunk_crc(png, png->png_data, (unsigned)png->png_datalen, png->idat_crc);
+				stream->next_out = png->png_data;
+				stream->avail_out = (unsigned)png->png_datalen;
+				png->idat_crc = crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)"IDAT", 4);
+			}
+
+			out = stream->next_out;
+			result = deflate(stream, (piece == len) ? flush : Z_NO_FLUSH);
+			if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+				return PNG_ZLIB_ERROR;
+
+			/* the CRC is updated while the compressed data is still in the cache */
+			png->idat_crc = crc32(png->idat_crc, out, (unsigned)(stream->next_out - out));
+		} while(stream->avail_in != 0 || (flush == Z_FINISH && piece == len && result != Z_STREAM_END));
+
+		data += piece;
+		len -= piece;
+	} while(len > 0);
+
+	return PNG_NO_ERROR;
+}
+
 static int png_write_idats(png_t* png, unsigned char* data)
 {
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+	size_t size = (size_t)png->width * png->height * png->bpp + png->height;
+	z_stream *stream;
+	int result;
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
 	(void)png_deflate;
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+	if(png_use_bands(png, (size_t)png->width * png->bpp))
+	{
+		struct png_band_writer* bw = png_new_band_writer(png, (size_t)png->width * png->bpp, 0);
+		size_t batch, done = 0;
+
+		if(!bw)
+			return PNG_MEMORY_ERROR;
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+		/* the rows are compressed a band per thread at a time */
+		batch = bw->band_len * bw->num_threads;
+		do
+		{
+			size_t len = size - done < batch ? size - done : batch;
+			result = png_deflate_bands(png, bw, data + done, len, done + len == size);
+			done += len;
+		} while(result == PNG_NO_ERROR && done < size);
+
+		png_free_band_writer(bw);
+		if(result != PNG_NO_ERROR)
+			return result;
+		png_write_iend(png);
+		return PNG_NO_ERROR;
+	}
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
+	/* compress the whole image in one stream, with the settings of png_write_set_compression, into IDAT
+	   chunks of PNG_STREAM_IDAT_LEN bytes, as png_write_rows does */
+	result = png_init_deflate(png, 0, 0);
+	if(result != PNG_NO_ERROR)
+	{
+		if(png->zs)
+			png_free(png->zs);
+		return result;
+	}
 
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	png->png_datalen = PNG_STREAM_IDAT_LEN;
+	png->png_data = png_alloc(png->png_datalen);
+	if(!png->png_data)
+	{
+		png_end_deflate(png);
+		return PNG_MEMORY_ERROR;
+	}
 
-	return PNG_NO_ERROR;
+	stream = png->zs;
+	stream->next_out = png->png_data;
+	stream->avail_out = (unsigned)png->png_datalen;
+	png->idat_crc = crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)"IDAT", 4);
+
+	result = png_stream_deflate(png, data, size, Z_FINISH);
+	if(result == PNG_NO_ERROR)
+	{
+		unsigned len = (unsigned)(stream->next_out - png->png_data);
+		if(len > 0)
+			png_write_idat_chunk_crc(png, png->png_data, len, png->idat_crc);
+		png_write_iend(png);
+	}
+
+	png_end_deflate(png);
+	png_free(png->png_data);
+	png->png_data = NULL;
+	png->png_datalen = 0;
+
+	return result;
 }
 
 static int png_read_idat(png_t* png, unsigned length)
 {
-#if DO_CRC_CHECKS
+	unsigned char *data;
 	unsigned orig_crc;
 	unsigned calc_crc;
-#endif
 
-	if(!png->readbuf || png->readbuflen < length)
+	if(png->mem)
+	{
+		/* inflate the chunk where it is, without copying it */
+		if(png->mem_len - png->mem_pos < length)
+			return PNG_FILE_ERROR;
+
+		data = (unsigned char*)png->mem + png->mem_pos;
+		png->mem_pos += length;
+	}
+	else
 	{
-		if (png->readbuf)
+		if(!png->readbuf || png->readbuflen < length)
 		{
-			png_free(png->readbuf);
+			if (png->readbuf)
+			{
+				png_free(png->readbuf);
+			}
+			png->readbuf = png_alloc(length);
+			png->readbuflen = length;
 		}
-		png->readbuf = png_alloc(length);
-		png->readbuflen = length;
-	}
 
-	if(!png->readbuf)
-	{
-		return PNG_MEMORY_ERROR;
+		if(!png->readbuf)
+		{
+			return PNG_MEMORY_ERROR;
+		}
+
+		if(file_read(png, png->readbuf, 1, length) != length)
+		{
+			return PNG_FILE_ERROR;
+		}
+
+		data = png->readbuf;
 	}
 
-	if(file_read(png, png->readbuf, 1, length) != length)
+	file_read_ul(png, &orig_crc);
+
+	if(png->crc_policy == PNG_CRC_VERIFY)
 	{
-		return PNG_FILE_ERROR;
+		calc_crc = crc32(0L, Z_NULL, 0);
+		calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
+		calc_crc = crc32(calc_crc, data, length);
+
+		if(orig_crc != calc_crc)
+		{
+			return PNG_CRC_ERROR;
+		}
 	}
 
-#if DO_CRC_CHECKS
-	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+	return png_inflate(png, data, length);
+}
+
+/* read the data and CRC of a chunk that is kept, such as the palette; small chunks are always checked right away */
+static int png_read_small_chunk(png_t* png, const char* type, unsigned char* data, unsigned length)
+{
+	unsigned orig_crc;
+	unsigned calc_crc;
+
+	if(file_read(png, data, 1, length) != length)
+		return PNG_FILE_ERROR;
 
 	file_read_ul(png, &orig_crc);
 
-	if(orig_crc != calc_crc)
+	if(png->crc_policy != PNG_CRC_SKIP)
 	{
-		return PNG_CRC_ERROR;
+		calc_crc = crc32(0L, Z_NULL, 0);
+		calc_crc = crc32(calc_crc, (const unsigned char*)type, 4);
+		calc_crc = crc32(calc_crc, data, length);
+
+		if(orig_crc != calc_crc)
+			return PNG_CRC_ERROR;
 	}
-#else
-	file_read_ul(png);
-#endif
 
-	return png_inflate(png, png->readbuf, length);
+	return PNG_NO_ERROR;
 }
 
 static int png_process_chunk(png_t* png)
@@ -566,9 +1127,9 @@ static int png_process_chunk(png_t* png)
 
 	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
 	{
-		if(!png->png_data) /* first IDAT */
+		if(!png->png_data) /* first IDAT: allocate the two-row window */
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
+			png->png_datalen = 2 * (png_row_bytes(png) + 1);
 			png->png_data = png_alloc(png->png_datalen);
 		}
 
@@ -588,6 +1149,22 @@ static int png_process_chunk(png_t* png)
 	{
 		return PNG_DONE;
 	}
+	else if(type == *(unsigned int*)"PLTE")
+	{
+		if(length % 3 != 0 || length > sizeof(png->palette))
+			return PNG_CRC_ERROR;
+
+		png->palette_len = (unsigned short)(length / 3);
+		return png_read_small_chunk(png, "PLTE", png->palette, length);
+	}
+	else if(type == *(unsigned int*)"tRNS")
+	{
+		if(length > sizeof(png->trns))
+			return PNG_CRC_ERROR;
+
+		png->trns_len = (unsigned short)length;
+		return png_read_small_chunk(png, "tRNS", png->trns, length);
+	}
 	else
 	{
 		file_read(png, 0, 1, length + 4); /* unknown chunk */
@@ -596,186 +1173,176 @@ static int png_process_chunk(png_t* png)
 	return result;
 }
 
-static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+int png_write_set_filter(png_t* png, int filter)
 {
-	int i;
-	unsigned char a = 0;
+	if(filter != PNG_FILTER_ADAPTIVE && (filter < PNG_FILTER_NONE || filter > PNG_FILTER_PAETH))
+		return PNG_UNKNOWN_FILTER;
 
-	for(i = 0; i < len; i++)
-	{
-		if(i >= stride)
-			a = out[i - stride];
-
-		out[i] = in[i] + a;
-	}
+	png->filter_choice = filter;
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+int png_write_set_compression(png_t* png, int level, int strategy, int window_bits, int mem_level)
 {
-	(void) stride;
-
-	int i;
+	if(level < Z_DEFAULT_COMPRESSION || level > 9)
+		return PNG_WRONG_ARGUMENTS;
+	if(strategy != Z_DEFAULT_STRATEGY && strategy != Z_FILTERED && strategy != Z_HUFFMAN_ONLY &&
+		strategy != Z_RLE && strategy != Z_FIXED)
+		return PNG_WRONG_ARGUMENTS;
+	if(window_bits < 9 || window_bits > MAX_WBITS || mem_level < 1 || mem_level > MAX_MEM_LEVEL)
+		return PNG_WRONG_ARGUMENTS;
 
-	if(prev_line)
-	{
-        for(i = 0; i < len; i++)
-		out[i] = in[i] + prev_line[i];
-	}
-	else
-		memcpy(out, in, len);
+	png->deflate_level = level;
+	png->deflate_strategy = strategy;
+	png->deflate_window_bits = window_bits;
+	png->deflate_mem_level = mem_level;
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+int png_write_set_threads(png_t* png, unsigned num_threads)
 {
-	int i;
-	unsigned char a = 0;
-	unsigned char b = 0;
-	unsigned int sum = 0;
+	if(num_threads == 0)
+		return PNG_WRONG_ARGUMENTS;
 
-	for(i = 0; i < len; i++)
-	{
-		if(prev_line)
-			b = prev_line[i];
+	png->deflate_threads = num_threads;
+	return PNG_NO_ERROR;
+}
 
-		if(i >= stride)
-			a = out[i - stride];
+/* filter one row into out (the filter type, followed by the filtered bytes); prev is the row above, unfiltered */
+static void png_filter_row(png_t* png, const unsigned char* row, const unsigned char* prev, unsigned char* out, size_t len)
+{
+	int filter = png->filter_choice;
 
-		sum = a;
-		sum += b;
+	if(filter == PNG_FILTER_ADAPTIVE)
+		filter = choose_filter(png->bpp, row, prev, len);
 
-		out[i] = (char)(in[i] + sum/2);
-	}
+	out[0] = (unsigned char)filter;
+	filter_row(filter, png->bpp, row, prev, out + 1, len);
 }
 
-static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c)
+/* filter the rows of png_set_data in place: row[0] of each is the filter type, followed by the row's pixel data */
+static int png_filter(png_t* png, unsigned char* data)
 {
-	int p = (int)a + b - c;
-	int pa = abs(p - a);
-	int pb = abs(p - b);
-	int pc = abs(p - c);
+	unsigned i;
+	size_t rowlen = (size_t)png->width * png->bpp;
+	unsigned char *row, *prev, *filtered;
 
-	int pr;
+	if(png->filter_choice == PNG_FILTER_NONE || png->height == 0)
+		return PNG_NO_ERROR;
 
-	if(pa <= pb && pa <= pc)
-		pr = a;
-	else if(pb <= pc)
-		pr = b;
-	else
-		pr = c;
+	/* one buffer holds the filtered row, then a row of zeros standing in for the row above the first */
+	filtered = png_alloc(2 * rowlen + 1);
+	if(!filtered)
+		return PNG_MEMORY_ERROR;
+	memset(filtered + rowlen + 1, 0, rowlen);
 
-	return (char)pr;
+	/* the rows are filtered from the bottom up, so the row above each one is still unfiltered */
+	for(i = png->height; i-- > 0; )
+	{
+		row = data + i * (rowlen + 1);
+		prev = i > 0 ? row - rowlen : filtered + rowlen + 1;
+		png_filter_row(png, row + 1, prev, filtered, rowlen);
+		memcpy(row, filtered, rowlen + 1);
+	}
+
+	png_free(filtered);
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+/* unfilter a row in place: row[0] is the filter type, followed by the row's pixel data */
+static int png_unfilter_row(png_t* png, unsigned char* row, unsigned char* prev_line)
 {
-	int i;
-	unsigned char a;
-	unsigned char b;
-	unsigned char c;
+	unsigned i;
+	unsigned char filter = row[0];
+	unsigned char *pixels = row + 1;
+	int stride = png->bpp;
+	size_t len = png_row_bytes(png);
 
-	for(i = 0; i < len; i++)
+	if(png->depth == 16)
 	{
-		if(prev_line && i >= stride)
+		for(i = 0; i < png->width * stride; i+=2)
 		{
-			a = out[i - stride];
-			b = prev_line[i];
-			c = prev_line[i - stride];
+			*(short*)(pixels+i) = (pixels[i] << 8) | pixels[i+1];
 		}
-		else
-		{
-			if(prev_line)
-				b = prev_line[i];
-			else
-				b = 0;
-
-			if(i >= stride)
-				a = out[i - stride];
-			else
-				a = 0;
-
-			c = 0;
-		}
-
-		out[i] = in[i] + png_paeth(a, b, c);
 	}
-}
 
-static int png_filter(png_t* png, unsigned char* data)
-{
-	(void) png;
-	(void) data;
+	/* the kernels are chosen for the processor at runtime (see png_unfilter.h) */
+	if(unfilter_row(filter, stride, pixels, prev_line, len) != 0)
+		return PNG_UNKNOWN_FILTER;
+
 	return PNG_NO_ERROR;
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/* the IDAT chunks of a png in memory, checked by a separate thread (PNG_CRC_BACKGROUND) */
+struct png_crc_job
 {
-	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	const unsigned char*		mem;
+	size_t				mem_len;
+	size_t				pos;			/* start of the first chunk after the header */
+	size_t				end;			/* chunks from here on are not needed (decoding stopped early) */
+	int				result;
+};
+
+static void* png_check_crcs(void* arg)
+{
+	struct png_crc_job *job = arg;
+	size_t pos = job->pos;
 
-	int stride = png->bpp;
+	job->result = PNG_NO_ERROR;
 
-	while(pos < png->png_datalen)
+	/* walk the chunks up to IEND; truncated data is left for the decoder to report */
+	while(job->mem_len - pos >= 8 && pos < __atomic_load_n(&job->end, __ATOMIC_RELAXED))
 	{
-		unsigned char filter = filtered[pos];
+		unsigned length = get_ul((unsigned char*)job->mem + pos);
+		const unsigned char *type = job->mem + pos + 4;
 
-		pos++;
-
-		if(png->depth == 16)
-		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
+		if(job->mem_len - pos - 8 < (size_t)length + 4 || memcmp(type, "IEND", 4) == 0)
+			break;
 
-		switch(filter)
+		if(memcmp(type, "IDAT", 4) == 0 &&
+		   crc32(crc32(0L, Z_NULL, 0), type, length + 4) != get_ul((unsigned char*)type + 4 + length))
 		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
+			job->result = PNG_CRC_ERROR;
 			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
 		}
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		pos += 8 + (size_t)length + 4;
 	}
 
-	return PNG_NO_ERROR;
+	return NULL;
 }
 
-int png_get_data(png_t* png, unsigned char* data)
+int png_get_rows(png_t* png, png_row_callback_t row_fun, void* user_pointer)
 {
 	int result = PNG_NO_ERROR;
+	struct png_crc_job crc_job;
+	pthread_t crc_thread;
+	int crc_in_background = 0;
+
+	/* the chunks of a png in memory can be checked while it is decoded; other pngs are checked as they are read */
+	if(png->crc_policy == PNG_CRC_BACKGROUND)
+	{
+		if(png->mem)
+		{
+			crc_job.mem = png->mem;
+			crc_job.mem_len = png->mem_len;
+			crc_job.pos = png->mem_pos;
+			crc_job.end = png->mem_len;
+			crc_in_background = pthread_create(&crc_thread, NULL, png_check_crcs, &crc_job) == 0;
+		}
+		if(!crc_in_background)
+			png->crc_policy = PNG_CRC_VERIFY;
+	}
 
 	png->zs = NULL;
 	png->png_datalen = 0;
 	png->png_data = NULL;
 	png->readbuf = NULL;
 	png->readbuflen = 0;
+	png->row_fun = row_fun;
+	png->row_user_pointer = user_pointer;
+	png->rows_done = 0;
+	png->rows_stopped = 0;
 
 	while(result == PNG_NO_ERROR)
 	{
@@ -791,48 +1358,239 @@ int png_get_data(png_t* png, unsigned char* data)
 	{
 		png_end_inflate(png);
 	}
+	png_free(png->png_data);
+	png->png_data = NULL;
 
-	if(result != PNG_DONE)
+	if(crc_in_background)
 	{
-		png_free(png->png_data);
-		return result;
+		/* only the chunks that were decoded need to be checked */
+		if(png->rows_stopped)
+			__atomic_store_n(&crc_job.end, png->mem_pos, __ATOMIC_RELAXED);
+		pthread_join(crc_thread, NULL);
+		if(crc_job.result != PNG_NO_ERROR && (result == PNG_DONE || result == PNG_NO_ERROR))
+			result = crc_job.result;
 	}
 
-	result = png_unfilter(png, data);
+	if(result != PNG_DONE)
+		return result;
 
-	png_free(png->png_data);
+	/* the image data ended before the last row */
+	if(png->rows_done != png->height && !png->rows_stopped)
+		return PNG_EOF_ERROR;
 
-	return result;
+	return PNG_NO_ERROR;
+}
+
+/* destination of the rows decoded by png_get_data */
+struct png_copy_target
+{
+	unsigned char*			data;
+	size_t				rowlen;
+};
+
+static int png_copy_row(unsigned char* row, unsigned y, void* user_pointer)
+{
+	struct png_copy_target *target = user_pointer;
+
+	memcpy(target->data + y * target->rowlen, row, target->rowlen);
+
+	return PNG_NO_ERROR;
+}
+
+int png_get_data(png_t* png, unsigned char* data)
+{
+	struct png_copy_target target;
+
+	target.data = data;
+	target.rowlen = png_row_bytes(png);
+
+	return png_get_rows(png, png_copy_row, &target);
 }
 
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
 {
 	//int i;
 	unsigned i;
+	size_t rowlen;
 	unsigned char *filtered;
+	int result;
 	png->width = width;
 	png->height = height;
 	png->depth = depth;
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	rowlen = (size_t)png->width * png->bpp;
+	filtered = png_alloc(rowlen * height + height);
+	if(!filtered)
+		return PNG_MEMORY_ERROR;
 
 	for(i = 0; i < png->height; i++)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		filtered[i*rowlen+i] = 0;
+		memcpy(&filtered[i*rowlen+i+1], data + i*rowlen, rowlen);
 	}
 
-	png_filter(png, filtered);
+	result = png_filter(png, filtered);
+	if(result != PNG_NO_ERROR)
+	{
+		png_free(filtered);
+		return result;
+	}
 	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	result = png_write_idats(png, filtered);
 
 	png_free(filtered);
 
+	return result;
+}
+
+static void png_free_write_buffers(png_t* png)
+{
+	png_free(png->png_data);
+	png_free(png->filter_buf);
+	png_free(png->prev_row);
+	png_free_band_writer(png->bands);
+	png->png_data = NULL;
+	png->filter_buf = NULL;
+	png->prev_row = NULL;
+	png->bands = NULL;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	int result;
+	size_t rowlen;
+	z_stream *stream;
+
+	png->width = width;
+	png->height = height;
+	png->depth = depth;
+	png->color_type = color;
+	png->bpp = png_get_bpp(png);
+	png->readbuf = NULL;
+	rowlen = (size_t)width * png->bpp;
+
+	png->bands = NULL;
+	png->png_datalen = PNG_STREAM_IDAT_LEN;
+	png->png_data = png_alloc(png->png_datalen);
+	png->filter_buf = png_alloc(rowlen + 1);
+	png->prev_row = png_alloc(rowlen + 1);
+	if(!png->png_data || !png->filter_buf || !png->prev_row)
+	{
+		png_free_write_buffers(png);
+		return PNG_MEMORY_ERROR;
+	}
+	memset(png->prev_row, 0, rowlen);
+
+	if(png_use_bands(png, rowlen))
+	{
+		/* the rows are compressed by png_deflate_bands instead of a stream of our own */
+		png->zs = NULL;
+		png->bands = png_new_band_writer(png, rowlen, 1);
+		if(!png->bands)
+		{
+			png_free_write_buffers(png);
+			return PNG_MEMORY_ERROR;
+		}
+		png_write_ihdr(png);
+		return PNG_NO_ERROR;
+	}
+
+	result = png_init_deflate(png, 0, 0);
+	if(result != PNG_NO_ERROR)
+	{
+		if(png->zs)
+			png_free(png->zs);
+		png_free_write_buffers(png);
+		return result;
+	}
+
+	stream = png->zs;
+	stream->next_out = png->png_data;
+	stream->avail_out = (unsigned)png->png_datalen;
+	png->idat_crc = crc32(crc32(0L, Z_NULL, 0), (const unsigned char *)"IDAT", 4);
+
+	png_write_ihdr(png);
+
 	return PNG_NO_ERROR;
 }
 
+int png_write_rows(png_t* png, unsigned char* data, unsigned num_rows)
+{
+	unsigned i;
+	unsigned char filter = PNG_FILTER_NONE;
+	size_t rowlen = (size_t)png->width * png->bpp;
+	unsigned char *row;
+	int result = PNG_NO_ERROR;
+
+	for(i = 0; i < num_rows && result == PNG_NO_ERROR; i++)
+	{
+		row = data + i*rowlen;
+		if(png->bands)
+		{
+			/* rows are filtered into the band buffer, which is compressed once it holds a band per thread */
+			struct png_band_writer* bw = png->bands;
+
+			png_filter_row(png, row, png->prev_row, bw->buf + bw->buf_len, rowlen);
+			memcpy(png->prev_row, row, rowlen);
+			bw->buf_len += rowlen + 1;
+			if(bw->buf_len == bw->band_len * bw->num_threads)
+			{
+				result = png_deflate_bands(png, bw, bw->buf, bw->buf_len, 0);
+				bw->buf_len = 0;
+			}
+			continue;
+		}
+		if(png->filter_choice == PNG_FILTER_NONE)
+		{
+			/* unfiltered rows are compressed straight from the caller's data */
+			result = png_stream_deflate(png, &filter, 1, Z_NO_FLUSH);
+			if(result == PNG_NO_ERROR)
+				result = png_stream_deflate(png, row, rowlen, Z_NO_FLUSH);
+			continue;
+		}
+
+		png_filter_row(png, row, png->prev_row, png->filter_buf, rowlen);
+		result = png_stream_deflate(png, png->filter_buf, rowlen + 1, Z_NO_FLUSH);
+		memcpy(png->prev_row, row, rowlen);
+	}
+
+	return result;
+}
+
+int png_write_end(png_t* png)
+{
+	z_stream *stream = png->zs;
+	int result;
+
+	if(png->bands)
+	{
+		struct png_band_writer* bw = png->bands;
+
+		result = png_deflate_bands(png, bw, bw->buf, bw->buf_len, 1);
+		if(result == PNG_NO_ERROR)
+			png_write_iend(png);
+		png_free_write_buffers(png);
+		return result;
+	}
+
+	result = png_stream_deflate(png, 0, 0, Z_FINISH);
+
+	if(result == PNG_NO_ERROR)
+	{
+		unsigned len = (unsigned)(stream->next_out - png->png_data);
+		if(len > 0)
+			png_write_idat_chunk_crc(png, png->png_data, len, png->idat_crc);
+		png_write_iend(png);
+	}
+
+	png_end_deflate(png);
+	png_free_write_buffers(png);
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
@@ -73,6 +73,17 @@ enum
 	PNG_TRUECOLOR_ALPHA		= 6
 };
 
+/*
+	How the CRCs of the IHDR and IDAT chunks are handled when reading (see png_set_crc_policy).
+*/
+
+enum
+{
+	PNG_CRC_VERIFY			= 0,
+	PNG_CRC_SKIP			= 1,
+	PNG_CRC_BACKGROUND		= 2
+};
+
 /*
 	Typedefs for callbacks.
 */
@@ -81,6 +92,7 @@ typedef unsigned (*png_write_callback_t)(void* input, size_t size, size_t numel,
 typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel, void* user_pointer);
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
+typedef int (*png_row_callback_t)(unsigned char* row, unsigned y, void* user_pointer);
 
 typedef struct
 {
@@ -90,7 +102,7 @@ typedef struct
 	void*				user_pointer;
 
 	unsigned char*			png_data;
-	unsigned			png_datalen;
+	size_t				png_datalen;
 
 	unsigned			width;
 	unsigned			height;
@@ -103,12 +115,40 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	const unsigned char*		mem;			/* data read in place (png_open_memory), or NULL */
+	size_t				mem_len;
+	size_t				mem_pos;
+	int				mem_mapped;		/* whether mem is a file mapping (png_open_file_mmap) */
+
+	unsigned char			palette[3*256];		/* RGB entries of the PLTE chunk, once it has been read */
+	unsigned short			palette_len;		/* number of entries */
+	unsigned char			trns[256];		/* data of the tRNS chunk (transparency), once it has been read */
+	unsigned short			trns_len;
+
+	int				crc_policy;		/* policy in effect when the png was opened */
+	unsigned long			idat_crc;		/* CRC of the IDAT chunk being written */
+	int				filter_choice;		/* filter type of the rows written, or PNG_FILTER_ADAPTIVE */
+	unsigned char*			filter_buf;		/* filter type and filtered bytes of the row being written */
+	unsigned char*			prev_row;		/* previous row written, unfiltered */
+	int				deflate_level;		/* compressor settings (see png_write_set_compression) */
+	int				deflate_strategy;
+	int				deflate_window_bits;
+	int				deflate_mem_level;
+	unsigned			deflate_threads;	/* threads compressing bands of rows (see png_write_set_threads) */
+	void*				bands;			/* state of the parallel compressor, or NULL */
+
+	png_row_callback_t		row_fun;		/* receives the decoded rows (see png_get_rows) */
+	void*				row_user_pointer;
+	unsigned			rows_done;
+	int				rows_stopped;		/* whether row_fun ended decoding early */
 } png_t;
 
 /*
 	Function: png_init
 
 	This function initializes pnglite. The parameters can be used to set your own memory allocation routines following these formats:
+	(Calling it is optional when malloc and free are to be used. The routines are shared by all threads, so this must not be called while another thread is using pnglite; apart from that, different png_t instances may be used concurrently from different threads.)
 
 	> void* (*custom_alloc)(size_t s)
 	> void (*custom_free)(void* p)
@@ -122,6 +162,26 @@ typedef struct
 
 int png_init(png_alloc_t pngalloc, png_free_t pngfree);
 
+/*
+	Function: png_set_crc_policy
+
+	This function selects how the CRCs of the chunks are handled by the pngs opened for reading afterwards:
+	PNG_CRC_VERIFY checks each chunk as it is read (the default), PNG_CRC_SKIP doesn't check them, which saves a pass
+	over the data of trusted files, and PNG_CRC_BACKGROUND checks the IDAT chunks in a separate thread while the image
+	is being decoded, so the check only costs time on a single core (png_get_rows then reports a CRC error only after
+	decoding). Pngs read through a callback or FILE* can't be checked ahead of the decoder, so PNG_CRC_BACKGROUND
+	checks them as PNG_CRC_VERIFY does. As with png_init, this must not be called while another thread is opening
+	pngs. CRCs are always written.
+
+	Parameters:
+		policy - PNG_CRC_VERIFY, PNG_CRC_SKIP or PNG_CRC_BACKGROUND
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the policy is unknown.
+*/
+
+int png_set_crc_policy(int policy);
+
 /*
 	Function: png_open_file
 
@@ -174,6 +234,41 @@ int png_open(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer);
 
+/*
+	Function: png_open_memory
+
+	This function reads a png that is already in memory. The chunks are parsed in place, and the compressed image data
+	is inflated straight from the buffer without being copied, so the buffer must stay valid (and unchanged) until the
+	png has been decoded. png_close_file should be called when done, as for a file.
+
+	Parameters:
+		png - png_t struct
+		data - the png file's contents
+		len - length of data in bytes
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_memory(png_t* png, const void* data, size_t len);
+
+/*
+	Function: png_open_file_mmap
+
+	This function maps a png file into memory and reads it as png_open_memory does, which avoids the many small reads
+	and the copy of every IDAT chunk made when reading through a FILE*. Files that can't be mapped (such as pipes) are
+	read with png_open_file_read instead. The file is unmapped (or closed) by png_close_file.
+
+	Parameters:
+		png - png_t struct
+		filename - Filename of the file to be opened.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_file_mmap(png_t *png, const char* filename);
+
 /*
 	Function: png_print_info
 
@@ -206,6 +301,8 @@ char* png_error_string(int error);
 
 	> width*height*(bytes per pixel)
 
+	(For bit depths below 8, each row is packed into (width*depth+7)/8 bytes instead.)
+
 	Parameters:
 		data - Where to store result.
 
@@ -215,12 +312,144 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_rows
+
+	This function decodes the opened png file one row at a time, passing each row to a callback as soon as it has
+	been inflated and unfiltered. Only the current row and the one above it are kept in memory, so no buffer for the
+	whole image is needed. The callback should be of the format:
+
+	> int (*png_row_callback_t)(unsigned char* row, unsigned y, void* user_pointer)
+
+	It is called for rows 0 to height-1 in order, with width*(bytes per pixel) bytes of pixel data (packed into
+	(width*depth+7)/8 bytes for bit depths below 8) that are only valid until it returns. The palette and
+	transparency chunks precede the image data, so palette and trns are filled in by the time the first row arrives. It should return PNG_NO_ERROR, PNG_DONE to stop decoding successfully once it has the
+	rows it needs (the rest of the image data is then not inflated, nor even read), or an error code to stop decoding.
+
+	Parameters:
+		png - png_t struct opened for reading
+		row_fun - Callback receiving the rows.
+		user_pointer - User pointer to be passed to row_fun.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_rows(png_t* png, png_row_callback_t row_fun, void* user_pointer);
+
+/*
+	Function: png_write_set_filter
+
+	This function chooses how the rows of a png opened for writing are filtered before they are compressed, by
+	png_set_data and png_write_rows. By default each row gets the filter type that makes its bytes smallest
+	(PNG_FILTER_ADAPTIVE, see png_filter.h), which is what makes most images compress well; a single filter type can be
+	used for every row instead, and PNG_FILTER_NONE is the fastest to write.
+
+	Parameters:
+		png - png_t struct opened for writing
+		filter - PNG_FILTER_ADAPTIVE, or one of PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVERAGE and
+		PNG_FILTER_PAETH.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_UNKNOWN_FILTER if the filter type is unknown.
+*/
+
+int png_write_set_filter(png_t* png, int filter);
+
+/*
+	Function: png_write_set_compression
+
+	This function sets up the zlib compressor used by png_set_data and png_write_begin for a png opened for
+	writing. By default zlib's default level and strategy are used, with the largest window.
+
+	Parameters:
+		png - png_t struct opened for writing
+		level - compression level, from 0 (no compression) to 9 (smallest output), or Z_DEFAULT_COMPRESSION (-1)
+		strategy - one of zlib's strategies: Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED
+		window_bits - base-2 logarithm of the compressor's window, from 9 to 15
+		mem_level - memory used by the compressor, from 1 (least, and slowest) to 9
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if a setting is out of range.
+*/
+
+int png_write_set_compression(png_t* png, int level, int strategy, int window_bits, int mem_level);
+
+/*
+	Function: png_write_set_threads
+
+	This function lets png_set_data and png_write_rows compress the image data on several threads. The filtered
+	rows are split into bands of about 512 KiB, and each thread compresses one band, primed with the end of the
+	band before it so that matches can still reach back across bands. The bands end with a sync flush and are joined
+	into one zlib stream, one IDAT chunk per band, whose checksum is combined from those of the bands. The output
+	is a little larger than with one thread, and up to one band per thread is buffered.
+
+	Parameters:
+		png - png_t struct opened for writing
+		num_threads - number of threads (1, the default, compresses the data as a single stream on the calling thread)
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if num_threads is 0.
+*/
+
+int png_write_set_threads(png_t* png, unsigned num_threads);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_write_begin
+
+	This function starts writing a png incrementally, as an alternative to png_set_data: it writes the header and
+	prepares the compressor. The image rows are then passed, in order, to png_write_rows, and png_write_end finishes
+	the file. Only a bounded amount of compressed data is buffered, so the whole image never has to be in memory.
+
+	Parameters:
+		png - png_t struct opened for writing
+		width, height, depth, color - as for png_set_data
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_rows
+
+	This function compresses the next rows of an image started with png_write_begin.
+
+	Parameters:
+		png - png_t struct
+		data - pixel data of the rows (width*(bytes per pixel) bytes per row)
+		num_rows - number of rows
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned num_rows);
+
+/*
+	Function: png_write_end
+
+	This function finishes an image started with png_write_begin, once all of its rows have been written, and
+	releases the compressor (it must be called even if writing the rows failed).
+
+	Parameters:
+		png - png_t struct
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 
-	Closes an open png file pointer. Should only be used when the png has been opened with png_open_file.
+	Closes an open png file pointer. Should only be used when the png has been opened with png_open_file (or one of the
+	png_open_file_* functions) or png_open_memory; a png read from memory is just detached from its buffer, and a mapped
+	file is unmapped.
 
 	Parameters:
 		png - png to close.
@@ -0,0 +1,1075 @@
+/*
+ * Implementation of the renderers that replay a list of recorded
+ * drawing commands onto a canvas.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "render.h"
+#include "threadpool.h"
+
+// work description for one horizontal band of the canvas
+struct BandJob {
+  struct Image view;            // rows [y0, y0 + view.height) of the canvas
+  int32_t y0;                   // first canvas row covered by the band
+  const struct DrawList *list;
+};
+
+void render_command(struct Image *img, const struct DrawList *list, const struct Command *cmd) {
+  switch (cmd->type) {
+  case CMD_RECT:
+    draw_rect(img, &cmd->rect, cmd->color);
+    break;
+  case CMD_CIRCLE:
+    draw_circle(img, cmd->x, cmd->y, cmd->r, cmd->color);
+    break;
+  case CMD_TILE:
+    draw_tile(img, cmd->x, cmd->y, list->images[cmd->src], &cmd->rect);
+    break;
+  case CMD_SPRITE:
+    draw_sprite(img, cmd->x, cmd->y, list->images[cmd->src], &cmd->rect);
+    break;
+  default:
+    assert(0);
+  }
+}
+
+// Store the span [lo, hi) of coordinates as a start and a length
+// that fit in int32_t. Pixels only have coordinates from 0 to
+// INT32_MAX - 1, so a span too long to represent is trimmed at
+// its negative end, and every pixel it covers is still covered. An
+// empty span gets a length of 0.
+static void saturate_span(int64_t lo, int64_t hi, int32_t *start, int32_t *len) {
+  if (hi > INT32_MAX) hi = INT32_MAX;
+  if (hi < INT32_MIN) hi = INT32_MIN;
+  if (lo < hi - INT32_MAX) lo = hi - INT32_MAX;
+  if (lo < INT32_MIN) lo = INT32_MIN;
+  if (lo > hi) lo = hi;
+  *start = (int32_t) lo;
+  *len = (int32_t) (hi - lo);
+}
+
+void command_bounds(const struct Command *cmd, struct Rect *box) {
+  // the box is computed in 64 bits, since a circle's box can be
+  // twice as wide as the int32_t range
+  int64_t x0, y0, width, height;
+  switch (cmd->type) {
+  case CMD_RECT:
+    x0 = cmd->rect.x;
+    y0 = cmd->rect.y;
+    width = cmd->rect.width;
+    height = cmd->rect.height;
+    break;
+  case CMD_CIRCLE:
+    x0 = (int64_t) cmd->x - cmd->r;
+    y0 = (int64_t) cmd->y - cmd->r;
+    width = 2 * (int64_t) cmd->r + 1;
+    height = 2 * (int64_t) cmd->r + 1;
+    break;
+  default:
+    // tiles and sprites are copied to x,y with the size of the source region
+    x0 = cmd->x;
+    y0 = cmd->y;
+    width = cmd->rect.width;
+    height = cmd->rect.height;
+    break;
+  }
+  saturate_span(x0, x0 + width, &box->x, &box->width);
+  saturate_span(y0, y0 + height, &box->y, &box->height);
+}
+
+int clipped_command_bounds(const struct Command *cmd, uint32_t width, uint32_t height,
+                           struct Rect *box) {
+  struct Rect b;
+  command_bounds(cmd, &b);
+
+  int64_t x0 = b.x, y0 = b.y;
+  int64_t x1 = x0 + b.width, y1 = y0 + b.height;
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > width) x1 = width;
+  if (y1 > height) y1 = height;
+  if (x0 >= x1 || y0 >= y1) {
+    return 0;
+  }
+
+  box->x = (int32_t) x0;
+  box->y = (int32_t) y0;
+  box->width = (int32_t) (x1 - x0);
+  box->height = (int32_t) (y1 - y0);
+  return 1;
+}
+
+int rects_intersect(const struct Rect *a, const struct Rect *b) {
+  return (int64_t) a->x < (int64_t) b->x + b->width && (int64_t) b->x < (int64_t) a->x + a->width &&
+         (int64_t) a->y < (int64_t) b->y + b->height && (int64_t) b->y < (int64_t) a->y + a->height;
+}
+
+int rect_contains(const struct Rect *outer, const struct Rect *inner) {
+  return inner->x >= outer->x && inner->y >= outer->y &&
+         (int64_t) inner->x + inner->width <= (int64_t) outer->x + outer->width &&
+         (int64_t) inner->y + inner->height <= (int64_t) outer->y + outer->height;
+}
+
+// Make a copy of a command translated by (-dx, -dy), for drawing
+// into a view whose origin is at dx,dy of the canvas.
+static void translate_command(const struct Command *cmd, int32_t dx, int32_t dy,
+                              struct Command *out) {
+  *out = *cmd;
+  if (out->type == CMD_RECT) {
+    out->rect.x -= dx;
+    out->rect.y -= dy;
+  } else {
+    out->x -= dx;
+    out->y -= dy;
+  }
+}
+
+//
+// Record the area touched by every command in the canvas's dirty
+// region. The renderers that draw into views of the canvas (whose
+// dirty regions aren't tracked) call this once rendering is done.
+//
+static void mark_commands_dirty(struct Image *canvas, const struct DrawList *list) {
+  if (canvas->dirty == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < list->num_cmds; i++) {
+    struct Rect box;
+    if (clipped_command_bounds(&list->cmds[i], canvas->width, canvas->height, &box)) {
+      image_mark_dirty(canvas, box.x, box.y, box.width, box.height);
+    }
+  }
+}
+
+void render_serial(struct Image *canvas, const struct DrawList *list) {
+  for (size_t i = 0; i < list->num_cmds; i++) {
+    render_command(canvas, list, &list->cmds[i]);
+  }
+}
+
+//
+// Replay every command that overlaps a band onto the band's view
+// of the canvas. The view starts at canvas row y0, so commands are
+// translated up by y0; the drawing functions then clip against the
+// view's bounds exactly as they would against the full canvas.
+//
+static void *render_band(void *arg) {
+  struct BandJob *job = arg;
+  const struct DrawList *list = job->list;
+  int64_t band_end = (int64_t) job->y0 + job->view.height;
+
+  for (size_t i = 0; i < list->num_cmds; i++) {
+    struct Rect box;
+    command_bounds(&list->cmds[i], &box);
+    if (box.height <= 0 || box.y >= band_end || (int64_t) box.y + box.height <= job->y0) {
+      continue;
+    }
+
+    struct Command shifted;
+    translate_command(&list->cmds[i], 0, job->y0, &shifted);
+    render_command(&job->view, list, &shifted);
+  }
+  return NULL;
+}
+
+void render_bands(struct Image *canvas, const struct DrawList *list, unsigned num_threads) {
+  if (num_threads > canvas->height) {
+    num_threads = canvas->height;
+  }
+  if (num_threads <= 1) {
+    render_serial(canvas, list);
+    return;
+  }
+
+  struct BandJob *jobs = malloc(num_threads * sizeof(struct BandJob));
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  int *started = calloc(num_threads, sizeof(int));
+  if (jobs == NULL || threads == NULL || started == NULL) {
+    free(jobs);
+    free(threads);
+    free(started);
+    render_serial(canvas, list);
+    return;
+  }
+
+  // split the rows as evenly as possible between the bands
+  uint32_t y = 0;
+  for (unsigned i = 0; i < num_threads; i++) {
+    uint32_t rows = canvas->height / num_threads + (i < canvas->height % num_threads);
+    jobs[i].view = (struct Image) {
+      .width = canvas->width,
+      .height = rows,
+      .data = canvas->data + (uint64_t) y * canvas->width,
+    };
+    jobs[i].y0 = (int32_t) y;
+    jobs[i].list = list;
+    y += rows;
+  }
+
+  // the calling thread renders the first band itself
+  for (unsigned i = 1; i < num_threads; i++) {
+    started[i] = (pthread_create(&threads[i], NULL, render_band, &jobs[i]) == 0);
+  }
+  render_band(&jobs[0]);
+  for (unsigned i = 1; i < num_threads; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      // couldn't start a thread for this band, so render it here
+      render_band(&jobs[i]);
+    }
+  }
+  mark_commands_dirty(canvas, list);
+
+  free(jobs);
+  free(threads);
+  free(started);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Binned tile renderer
+////////////////////////////////////////////////////////////////////////
+
+// queue of tiles owned by one worker: the owner takes tiles from the
+// front, and idle workers steal from the back
+struct TileQueue {
+  pthread_mutex_t lock;
+  uint32_t *tiles;
+  size_t head, tail;
+};
+
+// state shared by all of the tile workers
+struct TileRenderer {
+  struct Image *canvas;
+  const struct DrawList *list;
+  uint32_t tile_size, tiles_x, tiles_y;
+  size_t *bin_start;            // commands of tile t are bin_cmds[bin_start[t] .. bin_start[t+1])
+  size_t *bin_cmds;
+  struct TileQueue *queues;
+  unsigned num_workers;
+  struct TileStats *stats;
+};
+
+struct TileWorker {
+  struct TileRenderer *r;
+  unsigned id;
+  uint32_t *buf;                // tile_size * tile_size pixels
+  size_t steals;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+//
+// Take the next tile for a worker, from its own queue if possible,
+// otherwise by stealing from another worker's queue.
+//
+// Returns:
+//   1 if a tile was taken (stored in *tile), 0 if all queues are empty
+//
+static int take_tile(struct TileWorker *w, uint32_t *tile) {
+  struct TileRenderer *r = w->r;
+  for (unsigned k = 0; k < r->num_workers; k++) {
+    struct TileQueue *q = &r->queues[(w->id + k) % r->num_workers];
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+      *tile = (k == 0) ? q->tiles[q->head++] : q->tiles[--q->tail];
+      found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (found) {
+      w->steals += (k != 0);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//
+// Render one tile: copy its pixels into the worker's buffer, replay
+// the tile's commands onto the buffer (translated so the buffer acts
+// as the clip region), and copy the result back to the canvas.
+//
+static void render_tile(struct TileWorker *w, uint32_t tile) {
+  struct TileRenderer *r = w->r;
+  struct Image *canvas = r->canvas;
+  uint32_t x0 = (tile % r->tiles_x) * r->tile_size;
+  uint32_t y0 = (tile / r->tiles_x) * r->tile_size;
+  uint32_t tw = canvas->width - x0 < r->tile_size ? canvas->width - x0 : r->tile_size;
+  uint32_t th = canvas->height - y0 < r->tile_size ? canvas->height - y0 : r->tile_size;
+  uint32_t *origin = canvas->data + (uint64_t) y0 * canvas->width + x0;
+
+  for (uint32_t row = 0; row < th; row++) {
+    memcpy(w->buf + (uint64_t) row * tw, origin + (uint64_t) row * canvas->width, tw * sizeof(uint32_t));
+  }
+
+  struct Image view = { .width = tw, .height = th, .data = w->buf };
+  for (size_t i = r->bin_start[tile]; i < r->bin_start[tile + 1]; i++) {
+    struct Command shifted;
+    translate_command(&r->list->cmds[r->bin_cmds[i]], (int32_t) x0, (int32_t) y0, &shifted);
+    render_command(&view, r->list, &shifted);
+  }
+
+  for (uint32_t row = 0; row < th; row++) {
+    memcpy(origin + (uint64_t) row * canvas->width, w->buf + (uint64_t) row * tw, tw * sizeof(uint32_t));
+  }
+}
+
+static void *tile_worker_main(void *arg) {
+  struct TileWorker *w = arg;
+  struct TileStats *stats = w->r->stats;
+  uint32_t tile;
+
+  while (take_tile(w, &tile)) {
+    uint64_t start = now_ns();
+    render_tile(w, tile);
+    if (stats != NULL && stats->tile_ns != NULL) {
+      stats->tile_ns[tile] = now_ns() - start;
+      stats->tile_worker[tile] = w->id;
+    }
+  }
+  return NULL;
+}
+
+//
+// Bin each command into the tiles its clipped bounding box overlaps,
+// preserving command order within each tile.
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+//
+static int bin_commands(struct TileRenderer *r) {
+  const struct Command *cmds = r->list->cmds;
+  size_t n = r->list->num_cmds;
+  uint32_t ts = r->tile_size;
+  size_t num_tiles = (size_t) r->tiles_x * r->tiles_y;
+  struct Rect box;
+
+  r->bin_start = calloc(num_tiles + 1, sizeof(size_t));
+  if (r->bin_start == NULL) {
+    return -1;
+  }
+
+  // count the commands in each tile (offset by one, so that the
+  // prefix sum turns the counts into start positions)
+  for (size_t i = 0; i < n; i++) {
+    if (!clipped_command_bounds(&cmds[i], r->canvas->width, r->canvas->height, &box)) {
+      continue;
+    }
+    for (uint32_t ty = box.y / ts; ty <= (uint32_t) (box.y + box.height - 1) / ts; ty++) {
+      for (uint32_t tx = box.x / ts; tx <= (uint32_t) (box.x + box.width - 1) / ts; tx++) {
+        r->bin_start[(size_t) ty * r->tiles_x + tx + 1]++;
+      }
+    }
+  }
+  for (size_t t = 0; t < num_tiles; t++) {
+    r->bin_start[t + 1] += r->bin_start[t];
+  }
+
+  r->bin_cmds = malloc((r->bin_start[num_tiles] + 1) * sizeof(size_t));
+  size_t *fill = malloc(num_tiles * sizeof(size_t));
+  if (r->bin_cmds == NULL || fill == NULL) {
+    free(fill);
+    return -1;
+  }
+  memcpy(fill, r->bin_start, num_tiles * sizeof(size_t));
+
+  for (size_t i = 0; i < n; i++) {
+    if (!clipped_command_bounds(&cmds[i], r->canvas->width, r->canvas->height, &box)) {
+      continue;
+    }
+    for (uint32_t ty = box.y / ts; ty <= (uint32_t) (box.y + box.height - 1) / ts; ty++) {
+      for (uint32_t tx = box.x / ts; tx <= (uint32_t) (box.x + box.width - 1) / ts; tx++) {
+        size_t t = (size_t) ty * r->tiles_x + tx;
+        r->bin_cmds[fill[t]++] = i;
+      }
+    }
+  }
+  free(fill);
+
+  if (r->stats != NULL && r->stats->tile_cmds != NULL) {
+    for (size_t t = 0; t < num_tiles; t++) {
+      r->stats->tile_cmds[t] = (uint32_t) (r->bin_start[t + 1] - r->bin_start[t]);
+    }
+  }
+  return 0;
+}
+
+void render_tiles(struct Image *canvas, const struct DrawList *list,
+                  unsigned num_threads, uint32_t tile_size, struct TileStats *stats) {
+  if (tile_size == 0) {
+    tile_size = 64;
+  }
+
+  struct TileRenderer r = {
+    .canvas = canvas,
+    .list = list,
+    .tile_size = tile_size,
+    .tiles_x = (canvas->width + tile_size - 1) / tile_size,
+    .tiles_y = (canvas->height + tile_size - 1) / tile_size,
+    .stats = stats,
+  };
+  size_t num_tiles = (size_t) r.tiles_x * r.tiles_y;
+
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+    stats->tile_size = tile_size;
+    stats->tiles_x = r.tiles_x;
+    stats->tiles_y = r.tiles_y;
+    stats->tile_ns = calloc(num_tiles, sizeof(uint64_t));
+    stats->tile_cmds = calloc(num_tiles, sizeof(uint32_t));
+    stats->tile_worker = calloc(num_tiles, sizeof(unsigned));
+    if (stats->tile_ns == NULL || stats->tile_cmds == NULL || stats->tile_worker == NULL) {
+      free_tile_stats(stats);
+    }
+  }
+
+  if (num_tiles == 0) {
+    return;
+  }
+
+  unsigned num_workers = num_threads < 1 ? 1 : num_threads;
+  if (num_workers > num_tiles) {
+    num_workers = (unsigned) num_tiles;
+  }
+  r.num_workers = num_workers;
+
+  struct TileWorker *workers = calloc(num_workers, sizeof(struct TileWorker));
+  pthread_t *threads = calloc(num_workers, sizeof(pthread_t));
+  int *started = calloc(num_workers, sizeof(int));
+  r.queues = calloc(num_workers, sizeof(struct TileQueue));
+  uint32_t *order = malloc(num_tiles * sizeof(uint32_t));
+  uint32_t *bufs = malloc((size_t) num_workers * tile_size * tile_size * sizeof(uint32_t));
+
+  if (workers == NULL || threads == NULL || started == NULL || r.queues == NULL ||
+      order == NULL || bufs == NULL || bin_commands(&r) != 0) {
+    // not enough memory for binning, render everything directly
+    render_serial(canvas, list);
+  } else {
+    // give each worker a contiguous run of tiles in row-major order
+    for (size_t t = 0; t < num_tiles; t++) {
+      order[t] = (uint32_t) t;
+    }
+    for (unsigned i = 0; i < num_workers; i++) {
+      pthread_mutex_init(&r.queues[i].lock, NULL);
+      r.queues[i].tiles = order;
+      r.queues[i].head = num_tiles * i / num_workers;
+      r.queues[i].tail = num_tiles * (i + 1) / num_workers;
+      workers[i] = (struct TileWorker) {
+        .r = &r,
+        .id = i,
+        .buf = bufs + (size_t) i * tile_size * tile_size,
+      };
+    }
+
+    // the calling thread acts as worker 0
+    for (unsigned i = 1; i < num_workers; i++) {
+      started[i] = (pthread_create(&threads[i], NULL, tile_worker_main, &workers[i]) == 0);
+    }
+    tile_worker_main(&workers[0]);
+    for (unsigned i = 1; i < num_workers; i++) {
+      if (started[i]) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+    // tiles queued for a worker that couldn't be started were
+    // stolen by the others, so every tile has been rendered here
+
+    for (unsigned i = 0; i < num_workers; i++) {
+      pthread_mutex_destroy(&r.queues[i].lock);
+      if (stats != NULL) {
+        stats->steals += workers[i].steals;
+      }
+    }
+    if (stats != NULL) {
+      stats->num_workers = num_workers;
+    }
+    mark_commands_dirty(canvas, list);
+  }
+
+  free(r.bin_start);
+  free(r.bin_cmds);
+  free(workers);
+  free(threads);
+  free(started);
+  free(r.queues);
+  free(order);
+  free(bufs);
+}
+
+void report_tile_stats(FILE *out, const struct TileStats *stats) {
+  size_t num_tiles = (size_t) stats->tiles_x * stats->tiles_y;
+  if (stats->tile_ns == NULL || num_tiles == 0) {
+    fprintf(out, "tiles: no statistics available\n");
+    return;
+  }
+
+  uint64_t total = 0, min = UINT64_MAX, max = 0;
+  size_t slowest = 0;
+  for (size_t t = 0; t < num_tiles; t++) {
+    uint64_t ns = stats->tile_ns[t];
+    total += ns;
+    if (ns < min) {
+      min = ns;
+    }
+    if (ns > max) {
+      max = ns;
+      slowest = t;
+    }
+  }
+
+  fprintf(out, "tiles: %ux%u tiles of %u px, %u workers, %zu stolen\n",
+          stats->tiles_x, stats->tiles_y, stats->tile_size, stats->num_workers, stats->steals);
+  fprintf(out, "tile time: total %.3f ms, min %.3f ms, mean %.3f ms, max %.3f ms\n",
+          total / 1e6, min / 1e6, total / 1e6 / num_tiles, max / 1e6);
+  fprintf(out, "slowest tile: (%zu,%zu) with %u commands\n",
+          slowest % stats->tiles_x, slowest / stats->tiles_x, stats->tile_cmds[slowest]);
+
+  for (unsigned w = 0; w < stats->num_workers; w++) {
+    size_t count = 0;
+    uint64_t busy = 0;
+    for (size_t t = 0; t < num_tiles; t++) {
+      if (stats->tile_worker[t] == w) {
+        count++;
+        busy += stats->tile_ns[t];
+      }
+    }
+    fprintf(out, "worker %u: %zu tiles, %.3f ms\n", w, count, busy / 1e6);
+  }
+}
+
+void free_tile_stats(struct TileStats *stats) {
+  free(stats->tile_ns);
+  free(stats->tile_cmds);
+  free(stats->tile_worker);
+  stats->tile_ns = NULL;
+  stats->tile_cmds = NULL;
+  stats->tile_worker = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Conflict graph executor
+////////////////////////////////////////////////////////////////////////
+
+// size of the grid cells used to find overlapping commands
+#define DAG_CELL_SIZE 64
+
+// Conflict graph over the commands of a list: an edge i -> j (i < j)
+// means that the clipped destination boxes of commands i and j
+// overlap, so j has to be drawn after i. Edges implied by a path
+// through a command that covers the shared area may be left out.
+struct CommandGraph {
+  size_t num_cmds;
+  struct Rect *boxes;           // clipped destination boxes
+  uint8_t *visible;             // whether each command can touch the canvas
+  size_t *succ_start;           // successors of i are succ[succ_start[i] .. succ_start[i+1])
+  size_t *succ;
+  size_t *num_preds;            // number of predecessors of each command
+  size_t num_edges;
+};
+
+// the commands whose boxes overlap one grid cell, in list order
+struct CellList {
+  size_t *items;
+  size_t n, cap;
+};
+
+struct Edge {
+  size_t from, to;
+};
+
+static void free_command_graph(struct CommandGraph *g) {
+  free(g->boxes);
+  free(g->visible);
+  free(g->succ_start);
+  free(g->succ);
+  free(g->num_preds);
+}
+
+//
+// Build the conflict graph of a list's commands. Commands are binned
+// into grid cells; within a cell each command is compared with the
+// earlier commands in the cell, newest first, stopping at one whose
+// box covers the command's part of the cell (any earlier command
+// overlapping that part also overlaps the covering one, so the
+// dependency is implied).
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated
+//
+static int build_command_graph(const struct Image *canvas, const struct DrawList *list,
+                               struct CommandGraph *g) {
+  size_t n = list->num_cmds;
+  uint32_t cells_x = (canvas->width + DAG_CELL_SIZE - 1) / DAG_CELL_SIZE;
+  uint32_t cells_y = (canvas->height + DAG_CELL_SIZE - 1) / DAG_CELL_SIZE;
+  size_t num_cells = (size_t) cells_x * cells_y;
+
+  memset(g, 0, sizeof(*g));
+  g->num_cmds = n;
+  g->boxes = malloc((n + 1) * sizeof(struct Rect));
+  g->visible = calloc(n + 1, 1);
+  g->succ_start = calloc(n + 1, sizeof(size_t));
+  g->num_preds = calloc(n + 1, sizeof(size_t));
+  struct CellList *cells = calloc(num_cells + 1, sizeof(struct CellList));
+  size_t *linked = malloc((n + 1) * sizeof(size_t));
+  struct Edge *edges = NULL;
+  size_t num_edges = 0, edge_cap = 0;
+  int rc = 0;
+
+  if (g->boxes == NULL || g->visible == NULL || g->succ_start == NULL ||
+      g->num_preds == NULL || cells == NULL || linked == NULL) {
+    rc = -1;
+  }
+
+  for (size_t j = 0; j < n && rc == 0; j++) {
+    struct Rect *box = &g->boxes[j];
+    if (!clipped_command_bounds(&list->cmds[j], canvas->width, canvas->height, box)) {
+      continue;
+    }
+    g->visible[j] = 1;
+    linked[j] = SIZE_MAX;
+
+    uint32_t cx0 = box->x / DAG_CELL_SIZE, cx1 = (box->x + box->width - 1) / DAG_CELL_SIZE;
+    uint32_t cy0 = box->y / DAG_CELL_SIZE, cy1 = (box->y + box->height - 1) / DAG_CELL_SIZE;
+    for (uint32_t cy = cy0; cy <= cy1 && rc == 0; cy++) {
+      for (uint32_t cx = cx0; cx <= cx1 && rc == 0; cx++) {
+        struct CellList *cell = &cells[(size_t) cy * cells_x + cx];
+
+        // the part of the command's box inside this cell
+        int32_t x0 = (int32_t) (cx * DAG_CELL_SIZE), y0 = (int32_t) (cy * DAG_CELL_SIZE);
+        int32_t x1 = x0 + DAG_CELL_SIZE, y1 = y0 + DAG_CELL_SIZE;
+        if (box->x > x0) x0 = box->x;
+        if (box->y > y0) y0 = box->y;
+        if (box->x + box->width < x1) x1 = box->x + box->width;
+        if (box->y + box->height < y1) y1 = box->y + box->height;
+        struct Rect part = { x0, y0, x1 - x0, y1 - y0 };
+
+        for (size_t k = cell->n; k-- > 0; ) {
+          size_t i = cell->items[k];
+          if (linked[i] != j && rects_intersect(&g->boxes[i], box)) {
+            if (num_edges == edge_cap) {
+              size_t new_cap = edge_cap ? edge_cap * 2 : 256;
+              struct Edge *grown = realloc(edges, new_cap * sizeof(struct Edge));
+              if (grown == NULL) {
+                rc = -1;
+                break;
+              }
+              edges = grown;
+              edge_cap = new_cap;
+            }
+            edges[num_edges++] = (struct Edge) { i, j };
+            linked[i] = j;
+          }
+          if (rect_contains(&g->boxes[i], &part)) {
+            break;
+          }
+        }
+
+        if (rc == 0 && cell->n == cell->cap) {
+          size_t new_cap = cell->cap ? cell->cap * 2 : 16;
+          size_t *grown = realloc(cell->items, new_cap * sizeof(size_t));
+          if (grown == NULL) {
+            rc = -1;
+          } else {
+            cell->items = grown;
+            cell->cap = new_cap;
+          }
+        }
+        if (rc == 0) {
+          cell->items[cell->n++] = j;
+        }
+      }
+    }
+  }
+
+  if (rc == 0) {
+    // store the successors of each command contiguously
+    g->succ = malloc((num_edges + 1) * sizeof(size_t));
+    if (g->succ == NULL) {
+      rc = -1;
+    } else {
+      for (size_t e = 0; e < num_edges; e++) {
+        g->succ_start[edges[e].from + 1]++;
+        g->num_preds[edges[e].to]++;
+      }
+      for (size_t i = 0; i < n; i++) {
+        g->succ_start[i + 1] += g->succ_start[i];
+      }
+      size_t *fill = linked;  // reused as the insertion point of each command
+      memcpy(fill, g->succ_start, n * sizeof(size_t));
+      for (size_t e = 0; e < num_edges; e++) {
+        g->succ[fill[edges[e].from]++] = edges[e].to;
+      }
+      g->num_edges = num_edges;
+    }
+  }
+
+  for (size_t c = 0; cells != NULL && c < num_cells; c++) {
+    free(cells[c].items);
+  }
+  free(cells);
+  free(linked);
+  free(edges);
+  if (rc != 0) {
+    free_command_graph(g);
+  }
+  return rc;
+}
+
+// state shared by the tasks that draw the commands of a graph
+struct DagRun {
+  struct Image view;            // the canvas, without dirty tracking
+  const struct DrawList *list;
+  struct CommandGraph *g;
+  struct ThreadPool *pool;
+  struct DagTask *tasks;
+  uint64_t busy_ns;             // total time spent drawing, updated atomically
+};
+
+struct DagTask {
+  struct DagRun *run;
+  size_t index;
+};
+
+static void run_dag_command(void *arg);
+
+static void schedule_dag_command(struct DagRun *run, size_t i) {
+  if (threadpool_submit(run->pool, run_dag_command, &run->tasks[i]) != 0) {
+    // couldn't queue it, so draw it on this thread
+    run_dag_command(&run->tasks[i]);
+  }
+}
+
+//
+// Draw one command, then release the commands that were waiting
+// for it. Commands that are drawn at the same time never overlap,
+// so they write disjoint pixels of the canvas.
+//
+static void run_dag_command(void *arg) {
+  struct DagTask *task = arg;
+  struct DagRun *run = task->run;
+  struct CommandGraph *g = run->g;
+  size_t i = task->index;
+
+  uint64_t start = now_ns();
+  render_command(&run->view, run->list, &run->list->cmds[i]);
+  __atomic_fetch_add(&run->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+
+  for (size_t e = g->succ_start[i]; e < g->succ_start[i + 1]; e++) {
+    size_t s = g->succ[e];
+    if (__atomic_sub_fetch(&g->num_preds[s], 1, __ATOMIC_ACQ_REL) == 0) {
+      schedule_dag_command(run, s);
+    }
+  }
+}
+
+void render_dag(struct Image *canvas, const struct DrawList *list,
+                unsigned num_threads, struct DagStats *stats) {
+  uint64_t start = now_ns();
+  struct CommandGraph g;
+  struct ThreadPool *pool = NULL;
+  struct DagTask *tasks = NULL;
+  size_t *roots = NULL;
+
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+  }
+  if (build_command_graph(canvas, list, &g) != 0) {
+    render_serial(canvas, list);
+    return;
+  }
+  tasks = malloc((list->num_cmds + 1) * sizeof(struct DagTask));
+  roots = malloc((list->num_cmds + 1) * sizeof(size_t));
+  pool = (tasks != NULL && roots != NULL) ? threadpool_create(num_threads) : NULL;
+  if (pool == NULL) {
+    free(tasks);
+    free(roots);
+    free_command_graph(&g);
+    render_serial(canvas, list);
+    return;
+  }
+
+  if (stats != NULL) {
+    // the longest chain of dependent commands bounds the speedup
+    size_t *depth = calloc(list->num_cmds + 1, sizeof(size_t));
+    for (size_t i = 0; depth != NULL && i < list->num_cmds; i++) {
+      if (!g.visible[i]) {
+        continue;
+      }
+      stats->num_cmds++;
+      depth[i]++;
+      if (depth[i] > stats->critical_path) {
+        stats->critical_path = depth[i];
+      }
+      for (size_t e = g.succ_start[i]; e < g.succ_start[i + 1]; e++) {
+        if (depth[g.succ[e]] < depth[i]) {
+          depth[g.succ[e]] = depth[i];
+        }
+      }
+    }
+    free(depth);
+    stats->num_edges = g.num_edges;
+    stats->num_threads = threadpool_size(pool);
+    stats->build_ns = now_ns() - start;
+  }
+
+  struct DagRun run = {
+    .view = { .width = canvas->width, .height = canvas->height, .data = canvas->data },
+    .list = list,
+    .g = &g,
+    .pool = pool,
+    .tasks = tasks,
+  };
+  uint64_t render_start = now_ns();
+
+  // find the commands that don't depend on any others before starting
+  // any of them, since the workers update the predecessor counts
+  // (commands that can't touch the canvas are skipped entirely)
+  size_t num_roots = 0;
+  for (size_t i = 0; i < list->num_cmds; i++) {
+    tasks[i] = (struct DagTask) { &run, i };
+    if (g.visible[i] && g.num_preds[i] == 0) {
+      roots[num_roots++] = i;
+    }
+  }
+  for (size_t r = 0; r < num_roots; r++) {
+    schedule_dag_command(&run, roots[r]);
+  }
+  threadpool_wait(pool);
+  threadpool_destroy(pool);
+  mark_commands_dirty(canvas, list);
+
+  if (stats != NULL) {
+    stats->render_ns = now_ns() - render_start;
+    stats->busy_ns = run.busy_ns;
+  }
+  free(tasks);
+  free(roots);
+  free_command_graph(&g);
+}
+
+void report_dag_stats(FILE *out, const struct DagStats *stats) {
+  if (stats->num_threads == 0) {
+    fprintf(out, "dag: no statistics available\n");
+    return;
+  }
+  fprintf(out, "dag: %zu commands, %zu dependencies, critical path of %zu commands "
+          "(%.2f commands per step)\n",
+          stats->num_cmds, stats->num_edges, stats->critical_path,
+          stats->critical_path ? (double) stats->num_cmds / stats->critical_path : 0.0);
+  fprintf(out, "dag: graph built in %.3f ms, rendered in %.3f ms on %u threads, "
+          "achieved parallelism %.2f\n",
+          stats->build_ns / 1e6, stats->render_ns / 1e6, stats->num_threads,
+          stats->render_ns ? (double) stats->busy_ns / stats->render_ns : 0.0);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Pipelined render and encode
+////////////////////////////////////////////////////////////////////////
+
+// state shared by the rendering thread and the encoder thread
+struct StripPipeline {
+  pthread_mutex_t lock;
+  pthread_cond_t rows_ready_cond;
+  uint32_t rows_ready;          // canvas rows rendered so far (guarded by lock)
+  const struct Image *canvas;
+  struct ImageWriter *writer;
+  int rc;                       // result of the first failed write, or IMG_SUCCESS
+  uint64_t encode_ns;           // time spent compressing and writing
+  uint64_t wait_ns;             // time spent waiting for strips
+  uint64_t finished_ns;         // when the last row was written
+};
+
+//
+// Encoder thread: compress each group of rows as soon as the
+// rendering thread has finished it, until the whole canvas is
+// written. After a failed write the remaining rows are skipped.
+//
+static void *encode_strips(void *arg) {
+  struct StripPipeline *p = arg;
+  const struct Image *canvas = p->canvas;
+  uint32_t rows_done = 0;
+
+  while (rows_done < canvas->height) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&p->lock);
+    while (p->rows_ready == rows_done) {
+      pthread_cond_wait(&p->rows_ready_cond, &p->lock);
+    }
+    uint32_t ready = p->rows_ready;
+    pthread_mutex_unlock(&p->lock);
+    uint64_t got_rows = now_ns();
+    p->wait_ns += got_rows - start;
+
+    if (p->rc == IMG_SUCCESS) {
+      p->rc = write_image_rows(p->writer, canvas->data + (uint64_t) rows_done * canvas->width,
+                               ready - rows_done);
+    }
+    rows_done = ready;
+    p->encode_ns += now_ns() - got_rows;
+  }
+  p->finished_ns = now_ns();
+  return NULL;
+}
+
+int render_pipelined(struct Image *canvas, const struct DrawList *list, const char *filename,
+                     const struct ImageWriteOptions *opts, uint32_t strip_rows,
+                     struct PipelineStats *stats) {
+  uint64_t start = now_ns();
+  if (strip_rows == 0) {
+    strip_rows = 1;
+  }
+
+  struct StripPipeline p = {
+    .canvas = canvas,
+    .rc = IMG_SUCCESS,
+  };
+  int rc = open_image_writer_ex(filename, canvas->width, canvas->height, opts, &p.writer);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.rows_ready_cond, NULL);
+
+  pthread_t encoder;
+  int threaded = (canvas->height > 0 &&
+                  pthread_create(&encoder, NULL, encode_strips, &p) == 0);
+
+  // render the strips top to bottom, handing each one to the encoder
+  uint64_t render_ns = 0;
+  uint32_t num_strips = 0;
+  for (uint32_t y = 0; y < canvas->height; y += strip_rows) {
+    uint64_t strip_start = now_ns();
+    struct BandJob job = {
+      .view = {
+        .width = canvas->width,
+        .height = canvas->height - y < strip_rows ? canvas->height - y : strip_rows,
+        .data = canvas->data + (uint64_t) y * canvas->width,
+      },
+      .y0 = (int32_t) y,
+      .list = list,
+    };
+    render_band(&job);
+    render_ns += now_ns() - strip_start;
+    num_strips++;
+
+    pthread_mutex_lock(&p.lock);
+    p.rows_ready = y + job.view.height;
+    pthread_cond_signal(&p.rows_ready_cond);
+    pthread_mutex_unlock(&p.lock);
+  }
+  uint64_t rendered = now_ns();
+  mark_commands_dirty(canvas, list);
+
+  if (threaded) {
+    pthread_join(encoder, NULL);
+  } else {
+    // no encoder thread could be started, so encode everything here
+    encode_strips(&p);
+  }
+  rc = close_image_writer(p.writer);
+  if (p.rc != IMG_SUCCESS) {
+    rc = p.rc;
+  }
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.rows_ready_cond);
+
+  if (stats != NULL) {
+    uint64_t finished = now_ns();
+    stats->strip_rows = strip_rows;
+    stats->num_strips = num_strips;
+    stats->render_ns = render_ns;
+    stats->encode_ns = p.encode_ns;
+    stats->encode_wait_ns = threaded ? p.wait_ns : 0;
+    stats->drain_ns = finished - rendered;
+    stats->total_ns = finished - start;
+  }
+  return rc;
+}
+
+void report_pipeline_stats(FILE *out, const struct PipelineStats *stats) {
+  fprintf(out, "pipeline: %u strips of %u rows, render %.3f ms, encode %.3f ms "
+          "(%.3f ms waiting for strips), %.3f ms to finish encoding after rendering, "
+          "total %.3f ms\n",
+          stats->num_strips, stats->strip_rows, stats->render_ns / 1e6, stats->encode_ns / 1e6,
+          stats->encode_wait_ns / 1e6, stats->drain_ns / 1e6, stats->total_ns / 1e6);
+}
+
+int render_streamed(uint32_t width, uint32_t height, const struct DrawList *list,
+                    const char *filename, const struct ImageWriteOptions *opts,
+                    uint32_t strip_rows, struct PipelineStats *stats) {
+  uint64_t start = now_ns();
+  if (strip_rows == 0) {
+    strip_rows = 1;
+  }
+  if (height > 0 && strip_rows > height) {
+    strip_rows = height;
+  }
+
+  uint32_t *strip = malloc(((uint64_t) width * strip_rows + 1) * sizeof(uint32_t));
+  if (strip == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  struct ImageWriter *writer;
+  int rc = open_image_writer_ex(filename, width, height, opts, &writer);
+  if (rc != IMG_SUCCESS) {
+    free(strip);
+    return rc;
+  }
+
+  uint64_t render_ns = 0, encode_ns = 0, rendered = start;
+  uint32_t num_strips = 0;
+  for (uint32_t y = 0; y < height && rc == IMG_SUCCESS; y += strip_rows) {
+    uint64_t strip_start = now_ns();
+    struct BandJob job = {
+      .view = {
+        .width = width,
+        .height = height - y < strip_rows ? height - y : strip_rows,
+        .data = strip,
+      },
+      .y0 = (int32_t) y,
+      .list = list,
+    };
+    // a new canvas is opaque black (see init_image)
+    uint64_t num_pixels = (uint64_t) width * job.view.height;
+    for (uint64_t i = 0; i < num_pixels; i++) {
+      strip[i] = 0x000000FFU;
+    }
+    render_band(&job);
+    rendered = now_ns();
+    render_ns += rendered - strip_start;
+    num_strips++;
+
+    rc = write_image_rows(writer, strip, job.view.height);
+    encode_ns += now_ns() - rendered;
+  }
+
+  int close_rc = close_image_writer(writer);
+  if (rc == IMG_SUCCESS) {
+    rc = close_rc;
+  }
+  free(strip);
+
+  if (stats != NULL) {
+    uint64_t finished = now_ns();
+    stats->strip_rows = strip_rows;
+    stats->num_strips = num_strips;
+    stats->render_ns = render_ns;
+    stats->encode_ns = encode_ns;
+    stats->encode_wait_ns = 0;
+    stats->drain_ns = finished - rendered;
+    stats->total_ns = finished - start;
+  }
+  return rc;
+}
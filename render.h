@@ -0,0 +1,233 @@
+/*
+ * Header of the renderers that replay a list of recorded
+ * drawing commands onto a canvas.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "image.h"
+#include "drawing_funcs.h"
+#include "drawlist.h"
+
+// Draw a single command onto an image.
+//
+// Parameters:
+//   img  - pointer to destination struct Image
+//   list - pointer to the DrawList the command belongs to
+//   cmd  - pointer to the command to draw
+void render_command(struct Image *img, const struct DrawList *list, const struct Command *cmd);
+
+// Compute the bounding box of the destination pixels a command
+// may modify (before clipping to the canvas). A box too large for
+// struct Rect, such as that of a circle with a huge radius, is
+// trimmed to the coordinates pixels can have, and an empty box has
+// a width or height of 0.
+//
+// Parameters:
+//   cmd - pointer to the command
+//   box - pointer to struct Rect to receive the bounding box
+void command_bounds(const struct Command *cmd, struct Rect *box);
+
+// Compute the bounding box of a command clipped to a canvas of
+// the specified dimensions.
+//
+// Parameters:
+//   cmd    - pointer to the command
+//   width  - canvas width
+//   height - canvas height
+//   box    - pointer to struct Rect to receive the clipped bounding box
+//
+// Returns:
+//   1 if the clipped box is non-empty, 0 if the command can't
+//   modify any pixel of the canvas
+int clipped_command_bounds(const struct Command *cmd, uint32_t width, uint32_t height,
+                           struct Rect *box);
+
+// Check whether two rectangles share at least one pixel.
+//
+// Parameters:
+//   a - pointer to the first rectangle
+//   b - pointer to the second rectangle
+//
+// Returns:
+//   1 if the rectangles overlap, 0 if they don't
+int rects_intersect(const struct Rect *a, const struct Rect *b);
+
+// Check whether every pixel of one rectangle is inside another.
+//
+// Parameters:
+//   outer - pointer to the containing rectangle
+//   inner - pointer to the contained rectangle
+//
+// Returns:
+//   1 if outer contains inner, 0 otherwise
+int rect_contains(const struct Rect *outer, const struct Rect *inner);
+
+// Replay commands, in order, onto a canvas on the calling thread.
+//
+// Parameters:
+//   canvas - pointer to the destination struct Image
+//   list   - pointer to the DrawList holding the commands
+void render_serial(struct Image *canvas, const struct DrawList *list);
+
+// Replay commands onto a canvas using one worker thread per
+// horizontal band of the canvas. Every thread replays the full
+// command list clipped to its own band, so the output is identical
+// to render_serial.
+//
+// Parameters:
+//   canvas      - pointer to the destination struct Image
+//   list        - pointer to the DrawList holding the commands
+//   num_threads - number of bands/worker threads (1 renders serially)
+void render_bands(struct Image *canvas, const struct DrawList *list, unsigned num_threads);
+
+// Per-tile statistics collected by render_tiles. The arrays have
+// one entry per tile, in row-major tile order.
+struct TileStats {
+  uint32_t tile_size;       // width and height of a (non-edge) tile
+  uint32_t tiles_x;         // number of tile columns
+  uint32_t tiles_y;         // number of tile rows
+  uint64_t *tile_ns;        // time spent rendering each tile, in nanoseconds
+  uint32_t *tile_cmds;      // number of commands binned into each tile
+  unsigned *tile_worker;    // index of the worker thread that rendered each tile
+  unsigned num_workers;     // number of worker threads used
+  size_t steals;            // number of tiles taken from another worker's queue
+};
+
+// Replay commands onto a canvas divided into square screen tiles.
+// Each command is binned into the tiles its bounding box overlaps,
+// and a pool of work-stealing threads renders the tiles. A tile's
+// pixels are copied into a small buffer that serves as the clip
+// region for the drawing functions while the tile's commands are
+// replayed in order, so the output is identical to render_serial.
+//
+// Parameters:
+//   canvas      - pointer to the destination struct Image
+//   list        - pointer to the DrawList holding the commands
+//   num_threads - number of worker threads
+//   tile_size   - width and height of a tile in pixels
+//   stats       - if not NULL, receives per-tile statistics, which
+//                 should be released with free_tile_stats
+void render_tiles(struct Image *canvas, const struct DrawList *list,
+                  unsigned num_threads, uint32_t tile_size, struct TileStats *stats);
+
+// Print a summary of per-tile statistics.
+//
+// Parameters:
+//   out   - stream to print to
+//   stats - pointer to statistics filled in by render_tiles
+void report_tile_stats(FILE *out, const struct TileStats *stats);
+
+// Release the arrays held by a TileStats instance.
+//
+// Parameters:
+//   stats - pointer to statistics filled in by render_tiles
+void free_tile_stats(struct TileStats *stats);
+
+// Statistics collected by render_dag.
+struct DagStats {
+  size_t num_cmds;              // commands that can touch the canvas
+  size_t num_edges;             // dependencies between overlapping commands
+  size_t critical_path;         // length of the longest chain of dependent commands
+  unsigned num_threads;         // number of worker threads used
+  uint64_t build_ns;            // time spent building the conflict graph
+  uint64_t render_ns;           // wall time spent drawing
+  uint64_t busy_ns;             // total time the workers spent drawing
+};
+
+// Replay commands onto a canvas by building a conflict graph from
+// the commands' destination bounding boxes and drawing the commands
+// on a thread pool as soon as every earlier command they overlap has
+// been drawn. Commands that don't overlap run concurrently, and
+// commands that do are drawn in their original order, so the output
+// is identical to render_serial.
+//
+// Parameters:
+//   canvas      - pointer to the destination struct Image
+//   list        - pointer to the DrawList holding the commands
+//   num_threads - number of worker threads
+//   stats       - if not NULL, receives statistics about the graph
+//                 and the achieved parallelism
+void render_dag(struct Image *canvas, const struct DrawList *list,
+                unsigned num_threads, struct DagStats *stats);
+
+// Print the statistics collected by render_dag.
+//
+// Parameters:
+//   out   - stream to print to
+//   stats - pointer to statistics filled in by render_dag
+void report_dag_stats(FILE *out, const struct DagStats *stats);
+
+// Statistics collected by render_pipelined and render_streamed.
+struct PipelineStats {
+  uint32_t strip_rows;          // height of a (non-final) strip
+  uint32_t num_strips;          // number of strips rendered
+  uint64_t render_ns;           // time spent rendering strips
+  uint64_t encode_ns;           // time spent compressing and writing rows
+  uint64_t encode_wait_ns;      // time the encoder waited for strips to be rendered
+  uint64_t drain_ns;            // time from the last strip being rendered to the file being written
+  uint64_t total_ns;            // wall time from opening to closing the file
+};
+
+// Replay commands onto a canvas one horizontal strip at a time, from
+// top to bottom, and write the canvas to a PNG file. A separate
+// thread compresses each strip as soon as it is finished, so encoding
+// overlaps with rendering the rest of the canvas. The output is
+// identical to render_serial followed by write_image_ex.
+//
+// Parameters:
+//   canvas     - pointer to the destination struct Image
+//   list       - pointer to the DrawList holding the commands
+//   filename   - name of PNG file to write
+//   opts       - compression settings (NULL for the defaults)
+//   strip_rows - number of rows in a strip
+//   stats      - if not NULL, receives timing statistics
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the IMG_ERR_* values
+int render_pipelined(struct Image *canvas, const struct DrawList *list, const char *filename,
+                     const struct ImageWriteOptions *opts, uint32_t strip_rows,
+                     struct PipelineStats *stats);
+
+// Replay commands onto a canvas that is never held in memory as a
+// whole, and write it to a PNG file. The canvas is rendered one
+// horizontal strip at a time into a buffer (starting out opaque
+// black, like a canvas created by init_image), replaying every
+// command that overlaps the strip, and each finished strip is
+// compressed into the file before the next one is rendered. Memory
+// use is bounded by the strip size regardless of the canvas size,
+// and the output is identical to render_serial on a new canvas
+// followed by write_image_ex.
+//
+// Parameters:
+//   width      - canvas width
+//   height     - canvas height
+//   list       - pointer to the DrawList holding the commands
+//   filename   - name of PNG file to write
+//   opts       - compression settings (NULL for the defaults)
+//   strip_rows - number of rows in a strip
+//   stats      - if not NULL, receives timing statistics
+//                (encode_wait_ns is always 0)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the IMG_ERR_* values
+int render_streamed(uint32_t width, uint32_t height, const struct DrawList *list,
+                    const char *filename, const struct ImageWriteOptions *opts,
+                    uint32_t strip_rows, struct PipelineStats *stats);
+
+// Print the statistics collected by render_pipelined or render_streamed.
+//
+// Parameters:
+//   out   - stream to print to
+//   stats - pointer to statistics filled in by render_pipelined or
+//           render_streamed
+void report_pipeline_stats(FILE *out, const struct PipelineStats *stats);
+
+#endif // RENDER_H
@@ -10,13 +10,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "image.h"
 #include "drawing_funcs.h"
+#include "png_unfilter.h"
+#include "png_filter.h"
+#include "drawlist.h"
+#include "render.h"
 #include "tctest.h"
 
 // add prototypes for your helper functions
 int32_t in_bounds(struct Image *img, int32_t x, int32_t y); 
-uint32_t compute_index(struct Image *img, int32_t x, int32_t y);
+uint64_t compute_index(struct Image *img, int32_t x, int32_t y);
 int32_t clamp(int32_t val, int32_t min, int32_t max);
 uint8_t get_r(uint32_t color);
 uint8_t get_g(uint32_t color);
@@ -24,9 +31,10 @@ uint8_t get_b(uint32_t color);
 uint8_t get_a(uint32_t color);
 uint8_t blend_components(uint32_t fg, uint32_t bg, uint32_t alpha);
 uint32_t blend_colors(uint32_t fg, uint32_t bg);
-void set_pixel(struct Image *img, uint32_t index, uint32_t color);
+void set_pixel(struct Image *img, uint64_t index, uint32_t color);
 int64_t square(int64_t x);
 int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2);
+void put_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color);
 
 // an expected color identified by a (non-zero) character code
 typedef struct {
@@ -102,8 +110,10 @@ void test_draw_pixel(TestObjs *objs);
 void test_draw_rect(TestObjs *objs);
 void test_draw_circle(TestObjs *objs);
 void test_draw_circle_clip(TestObjs *objs);
+void test_draw_circle_far(TestObjs *objs);
 void test_draw_tile(TestObjs *objs);
 void test_draw_sprite(TestObjs *objs);
+void test_draw_blit_far(TestObjs *objs);
 
 void test_in_bounds(TestObjs *objs);
 void test_compute_index(TestObjs *objs);
@@ -119,6 +129,21 @@ void test_get_b(TestObjs *objs);
 void test_get_a(TestObjs *objs);
 void test_blend_colors(TestObjs *objs);
 void test_square_dist(TestObjs *objs);
+void test_dirty_tracking(TestObjs *objs);
+void test_unfilter_kernels(TestObjs *objs);
+void test_pixels_to_rgba(TestObjs *objs);
+void test_indices_to_rgba(TestObjs *objs);
+void test_crc_policy(TestObjs *objs);
+void test_read_image_region(TestObjs *objs);
+void test_image_cache(TestObjs *objs);
+void test_read_image_from_memory(TestObjs *objs);
+void test_filter_kernels(TestObjs *objs);
+void test_write_filters(TestObjs *objs);
+void test_write_options(TestObjs *objs);
+void test_write_threads(TestObjs *objs);
+void test_render_huge_circle(TestObjs *objs);
+void test_render_overflowing_rects(TestObjs *objs);
+void test_cull_overflowing_rects(TestObjs *objs);
 
 int main(int argc, char **argv) {
   if (argc > 1) {
@@ -133,8 +158,10 @@ int main(int argc, char **argv) {
   TEST(test_draw_rect);
   TEST(test_draw_circle);
   TEST(test_draw_circle_clip);
+  TEST(test_draw_circle_far);
   TEST(test_draw_sprite);
   TEST(test_draw_tile);
+  TEST(test_draw_blit_far);
 
   TEST(test_in_bounds);
   TEST(test_compute_index);
@@ -150,6 +177,21 @@ int main(int argc, char **argv) {
   TEST(test_get_a);
   TEST(test_blend_colors);
   TEST(test_square_dist);
+  TEST(test_dirty_tracking);
+  TEST(test_unfilter_kernels);
+  TEST(test_pixels_to_rgba);
+  TEST(test_indices_to_rgba);
+  TEST(test_crc_policy);
+  TEST(test_read_image_region);
+  TEST(test_image_cache);
+  TEST(test_read_image_from_memory);
+  TEST(test_filter_kernels);
+  TEST(test_write_filters);
+  TEST(test_write_options);
+  TEST(test_write_threads);
+  TEST(test_render_huge_circle);
+  TEST(test_render_overflowing_rects);
+  TEST(test_cull_overflowing_rects);
 
   TEST_FINI();
 }
@@ -228,6 +270,27 @@ void test_draw_circle_clip(TestObjs *objs) {
   check_picture(&objs->small, &expected);
 }
 
+void test_draw_circle_far(TestObjs *objs) {
+  Picture expected = {
+    { {' ', 0x000000FF}, {'x', 0x00FF00FF} },
+    "        "
+    "        "
+    "        "
+    "        "
+    "        "
+    "x       "
+  };
+
+  // circles centered at the most negative coordinates are entirely
+  // outside the image (and drawing them has to finish)
+  draw_circle(&objs->small, INT32_MIN, 2, 3, 0x00FF00FF);
+  draw_circle(&objs->small, 3, INT32_MIN, 3, 0x00FF00FF);
+  draw_circle(&objs->small, INT32_MIN, INT32_MIN, INT32_MAX, 0x00FF00FF);
+  draw_circle(&objs->small, -1, 5, 1, 0x00FF00FF);
+
+  check_picture(&objs->small, &expected);
+}
+
 void test_draw_tile(TestObjs *objs) {
   ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
 
@@ -314,6 +377,32 @@ void test_draw_sprite(TestObjs *objs) {
   check_picture(&objs->large, &pic);
 }
 
+void test_draw_blit_far(TestObjs *objs) {
+  ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
+  ASSERT(read_image("img/NpcGuest.png", &objs->spritemap) == IMG_SUCCESS);
+
+  Picture expected = {
+    { {' ', 0x000000FF} },
+    "        "
+    "        "
+    "        "
+    "        "
+    "        "
+    "        "
+  };
+
+  // tiles and sprites copied to the most negative coordinates are
+  // entirely outside the image
+  struct Rect grass = { .x = 0, .y = 16, .width = 16, .height = 16 };
+  struct Rect sue = { .x = 128, .y = 136, .width = 16, .height = 15 };
+  draw_tile(&objs->small, INT32_MIN, 0, &objs->tilemap, &grass);
+  draw_tile(&objs->small, 0, INT32_MIN, &objs->tilemap, &grass);
+  draw_sprite(&objs->small, INT32_MIN, 0, &objs->spritemap, &sue);
+  draw_sprite(&objs->small, 0, INT32_MIN, &objs->spritemap, &sue);
+
+  check_picture(&objs->small, &expected);
+}
+
 void test_in_bounds(TestObjs *objs) {
   {
     //within bounds
@@ -405,6 +494,12 @@ void test_compute_index(TestObjs *objs) {
   ASSERT(compute_index(&objs->large, LARGE_W, 0) == 24);
   ASSERT(compute_index(&objs->large, 0, LARGE_H) == 480);
 }
+{
+  //indices past 2^32 for a very large image (no pixel data needed)
+  struct Image huge = { .width = 70000, .height = 70000, .data = NULL };
+  ASSERT(compute_index(&huge, 69999, 69999) == 4899999999ULL);
+  ASSERT(compute_index(&huge, 0, 61360) == 4295200000ULL);
+}
 }
 
 void test_clamp(TestObjs *objs) {
@@ -632,4 +727,688 @@ void test_square_dist(TestObjs *objs) {
 
   ASSERT(square_dist(0, 0, 3, 4) == 25);
   ASSERT(square_dist(-3, -4, 3, 4) == 100);
-}
\ No newline at end of file
+}
+void test_dirty_tracking(TestObjs *objs) {
+  const struct DirtyRect *rects;
+
+  // nothing is recorded unless tracking is enabled
+  ASSERT(objs->large.dirty == NULL);
+  draw_pixel(&objs->large, 1, 1, 0xFF0000FF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 0);
+
+  ASSERT(image_track_dirty(&objs->large) == IMG_SUCCESS);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 0);
+
+  // rectangles are clipped to the image
+  struct Rect r = { .x = -2, .y = 3, .width = 6, .height = 4 };
+  draw_rect(&objs->large, &r, 0x00FF00FF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 1);
+  ASSERT(rects[0].x == 0 && rects[0].y == 3 && rects[0].width == 4 && rects[0].height == 4);
+
+  // a pixel inside an existing rectangle adds nothing
+  draw_pixel(&objs->large, 2, 4, 0x0000FFFF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 1);
+
+  // a separate circle gets its own (clipped) bounding box
+  draw_circle(&objs->large, 20, 17, 5, 0x0000FFFF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 2);
+  ASSERT(rects[1].x == 15 && rects[1].y == 12 && rects[1].width == 9 && rects[1].height == 8);
+
+  // a rectangle overlapping both is merged with them
+  struct Rect joined = { .x = 3, .y = 5, .width = 13, .height = 8 };
+  draw_rect(&objs->large, &joined, 0xFFFFFFFF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 1);
+  ASSERT(rects[0].x == 0 && rects[0].y == 3 && rects[0].width == 24 && rects[0].height == 17);
+
+  // drawing outside the image records nothing
+  image_reset_dirty(&objs->large);
+  draw_pixel(&objs->large, -1, 0, 0xFF0000FF);
+  draw_circle(&objs->large, -10, -10, 3, 0xFF0000FF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 0);
+
+  // put_pixel doesn't record anything by itself
+  put_pixel(&objs->large, 0, 0, 0xFF0000FF);
+  ASSERT(objs->large.data[0] == 0xFF0000FF);
+  ASSERT(image_get_dirty(&objs->large, &rects) == 0);
+
+  image_untrack_dirty(&objs->large);
+  ASSERT(objs->large.dirty == NULL);
+}
+
+// Check that a SIMD unfilter kernel gives the same result as the
+// scalar kernel for one filter type and pixel size, on random rows
+// of every length up to 40 pixels (with and without a previous row).
+// Half of the rows only use a few byte values, so that the Paeth
+// predictor's ties are exercised.
+void check_unfilter_kernel(int (*kernel)(int, int, unsigned char *, const unsigned char *, size_t),
+                           int filter, int bpp) {
+  unsigned char prev[40 * 8], expected[40 * 8], actual[40 * 8];
+  static const unsigned char few[] = { 0, 1, 2, 127, 128, 254, 255 };
+
+  for (int trial = 0; trial < 8; trial++) {
+    for (size_t len = 0; len <= sizeof(prev) / 8 * bpp; len++) {
+      for (size_t i = 0; i < len; i++) {
+        prev[i] = (trial & 1) ? few[rand() % 7] : (unsigned char) rand();
+        expected[i] = actual[i] = (trial & 1) ? few[rand() % 7] : (unsigned char) rand();
+      }
+      const unsigned char *above = (trial % 4 == 3) ? NULL : prev;
+      ASSERT(unfilter_row_scalar(filter, bpp, expected, above, len) == 0);
+      ASSERT(kernel(filter, bpp, actual, above, len) == 0);
+      ASSERT(memcmp(expected, actual, len) == 0);
+    }
+  }
+}
+
+void test_unfilter_kernels(TestObjs *objs) {
+  (void) objs;
+#ifdef PNG_UNFILTER_HAVE_X86
+  srand(42);
+  for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+    // 3 and 4 bytes per pixel have specialized kernels, the others
+    // fall back to the scalar kernels
+    for (int bpp = 1; bpp <= 8; bpp++) {
+      check_unfilter_kernel(unfilter_row_sse2, filter, bpp);
+      if (unfilter_have_ssse3()) {
+        check_unfilter_kernel(unfilter_row_ssse3, filter, bpp);
+      }
+      check_unfilter_kernel(unfilter_row, filter, bpp);
+    }
+  }
+
+  unsigned char row[4] = { 1, 2, 3, 4 };
+  ASSERT(unfilter_row_sse2(5, 4, row, NULL, 4) == -1);
+#endif
+  unsigned char bytes[4] = { 1, 2, 3, 4 };
+  ASSERT(unfilter_row_scalar(5, 4, bytes, NULL, 4) == -1);
+  ASSERT(unfilter_row(5, 4, bytes, NULL, 4) == -1);
+}
+
+// Check that a SIMD pixel conversion kernel gives the same result as
+// the scalar kernel for every row length up to 40 pixels.
+void check_rgba_kernel(void (*kernel)(int, const unsigned char *, uint32_t *, size_t), int bpp) {
+  unsigned char src[40 * 4];
+  uint32_t expected[40], actual[40];
+
+  for (size_t n = 0; n <= 40; n++) {
+    for (size_t i = 0; i < n * bpp; i++) {
+      src[i] = (unsigned char) rand();
+    }
+    pixels_to_rgba_scalar(bpp, src, expected, n);
+    kernel(bpp, src, actual, n);
+    ASSERT(memcmp(expected, actual, n * sizeof(uint32_t)) == 0);
+  }
+}
+
+void test_pixels_to_rgba(TestObjs *objs) {
+  (void) objs;
+  const unsigned char rgb[] = { 0x12, 0x34, 0x56, 0x9A, 0xBC, 0xDE };
+  const unsigned char rgba[] = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0 };
+  uint32_t pixels[2];
+
+  pixels_to_rgba(3, rgb, pixels, 2);
+  ASSERT(pixels[0] == 0x123456FF && pixels[1] == 0x9ABCDEFF);
+  pixels_to_rgba(4, rgba, pixels, 2);
+  ASSERT(pixels[0] == 0x12345678 && pixels[1] == 0x9ABCDEF0);
+  const unsigned char gray_alpha[] = { 0x12, 0x34, 0x56, 0x78 };
+  pixels_to_rgba(2, gray_alpha, pixels, 2);
+  ASSERT(pixels[0] == 0x12121234 && pixels[1] == 0x56565678);
+
+#ifdef PNG_UNFILTER_HAVE_X86
+  srand(7);
+  for (int bpp = 2; bpp <= 4; bpp++) {
+    check_rgba_kernel(pixels_to_rgba_sse2, bpp);
+    if (unfilter_have_ssse3()) {
+      check_rgba_kernel(pixels_to_rgba_ssse3, bpp);
+    }
+  }
+#endif
+}
+
+void test_indices_to_rgba(TestObjs *objs) {
+  (void) objs;
+  uint32_t lut[256], pixels[8];
+  for (int i = 0; i < 256; i++) {
+    lut[i] = 0x01010100U * i + 0xFF;
+  }
+
+  // 8-bit indices, starting at the second one
+  const unsigned char bytes[] = { 7, 200, 0, 255 };
+  indices_to_rgba(8, bytes, 1, lut, pixels, 3);
+  ASSERT(pixels[0] == lut[200] && pixels[1] == lut[0] && pixels[2] == lut[255]);
+
+  // packed indices, from the most significant bits down
+  const unsigned char packed[] = { 0xB4, 0x1E };  // 1011 0100 0001 1110
+  indices_to_rgba(4, packed, 0, lut, pixels, 4);
+  ASSERT(pixels[0] == lut[0xB] && pixels[1] == lut[0x4] && pixels[2] == lut[0x1] && pixels[3] == lut[0xE]);
+  indices_to_rgba(2, packed, 3, lut, pixels, 3);
+  ASSERT(pixels[0] == lut[0] && pixels[1] == lut[0] && pixels[2] == lut[1]);
+  indices_to_rgba(1, packed, 6, lut, pixels, 4);
+  ASSERT(pixels[0] == lut[0] && pixels[1] == lut[0] && pixels[2] == lut[0] && pixels[3] == lut[0]);
+  indices_to_rgba(1, packed, 11, lut, pixels, 4);
+  ASSERT(pixels[0] == lut[1] && pixels[1] == lut[1] && pixels[2] == lut[1] && pixels[3] == lut[1]);
+}
+
+// Read a PNG file with the given checksum policy, and report whether
+// it could be read.
+int read_with_crc_policy(const char *filename, int policy) {
+  struct Image img;
+  image_set_crc_policy(policy);
+  int rc = read_image(filename, &img);
+  image_set_crc_policy(IMG_CRC_VERIFY);
+  if (rc == IMG_SUCCESS) {
+    free(img.data);
+  }
+  return rc == IMG_SUCCESS;
+}
+
+void test_crc_policy(TestObjs *objs) {
+  char filename[] = "/tmp/test_crc_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT(fd >= 0);
+  close(fd);
+  ASSERT(write_image(filename, &objs->small) == IMG_SUCCESS);
+
+  // the checksums written as the data was compressed are correct
+  ASSERT(read_with_crc_policy(filename, IMG_CRC_VERIFY));
+  ASSERT(read_with_crc_policy(filename, IMG_CRC_BACKGROUND));
+
+  // corrupt the checksum of the IDAT chunk, which follows the
+  // signature (8 bytes) and the IHDR chunk (25 bytes)
+  FILE *f = fopen(filename, "r+b");
+  ASSERT(f != NULL);
+  unsigned char len[4];
+  ASSERT(fseek(f, 33, SEEK_SET) == 0 && fread(len, 1, 4, f) == 4);
+  long crc_pos = 41 + ((long) len[0] << 24 | len[1] << 16 | len[2] << 8 | len[3]);
+  int c;
+  ASSERT(fseek(f, crc_pos, SEEK_SET) == 0 && (c = fgetc(f)) != EOF);
+  ASSERT(fseek(f, crc_pos, SEEK_SET) == 0 && fputc(c ^ 1, f) != EOF);
+  fclose(f);
+
+  ASSERT(!read_with_crc_policy(filename, IMG_CRC_VERIFY));
+  ASSERT(!read_with_crc_policy(filename, IMG_CRC_BACKGROUND));
+  ASSERT(read_with_crc_policy(filename, IMG_CRC_SKIP));
+  remove(filename);
+}
+
+// Check that a region read from a PNG file matches the same pixels
+// of the whole image.
+void check_image_region(const struct Image *whole, const struct Rect *roi,
+                        int32_t x, int32_t y, int32_t width, int32_t height) {
+  struct Image region;
+  ASSERT(read_image_region("img/PrtMimi.png", roi, &region) == IMG_SUCCESS);
+  ASSERT(region.width == (uint32_t) width && region.height == (uint32_t) height);
+  for (int32_t j = 0; j < height; j++) {
+    ASSERT(memcmp(region.data + j * width, whole->data + (y + j) * whole->width + x,
+                  width * sizeof(uint32_t)) == 0);
+  }
+  free(region.data);
+}
+
+void test_read_image_region(TestObjs *objs) {
+  ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
+  int32_t w = objs->tilemap.width, h = objs->tilemap.height;
+
+  struct Rect tile = { .x = 16, .y = 32, .width = 16, .height = 16 };
+  check_image_region(&objs->tilemap, &tile, 16, 32, 16, 16);
+  struct Rect first_row = { .x = 0, .y = 0, .width = w, .height = 1 };
+  check_image_region(&objs->tilemap, &first_row, 0, 0, w, 1);
+  struct Rect everything = { .x = 0, .y = 0, .width = w, .height = h };
+  check_image_region(&objs->tilemap, &everything, 0, 0, w, h);
+
+  // regions are clipped to the image
+  struct Rect corner = { .x = w - 5, .y = h - 3, .width = 40, .height = 40 };
+  check_image_region(&objs->tilemap, &corner, w - 5, h - 3, 5, 3);
+  struct Rect around = { .x = -10, .y = -10, .width = w + 20, .height = 12 };
+  check_image_region(&objs->tilemap, &around, 0, 0, w, 2);
+
+  struct Image region;
+  struct Rect outside = { .x = w, .y = 0, .width = 10, .height = 10 };
+  ASSERT(read_image_region("img/PrtMimi.png", &outside, &region) == IMG_ERR_EMPTY_REGION);
+  struct Rect empty = { .x = 0, .y = 0, .width = 0, .height = 10 };
+  ASSERT(read_image_region("img/PrtMimi.png", &empty, &region) == IMG_ERR_EMPTY_REGION);
+}
+
+// Delete a directory along with the files in it.
+void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  ASSERT(dir != NULL);
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+      ASSERT(unlinkat(dirfd(dir), ent->d_name, 0) == 0);
+    }
+  }
+  closedir(dir);
+  ASSERT(rmdir(path) == 0);
+}
+
+void test_image_cache(TestObjs *objs) {
+  char dir[] = "/tmp/test_cache_XXXXXX";
+  ASSERT(mkdtemp(dir) != NULL);
+  ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
+  uint64_t size = (uint64_t) objs->tilemap.width * objs->tilemap.height * sizeof(uint32_t);
+
+  struct ImageCacheStats before, after;
+  image_cache_get_stats(&before);
+  ASSERT(image_cache_enable(dir, 10 * size) == IMG_SUCCESS);
+
+  // the first read decodes and stores the image, the second maps it
+  struct Image first, second;
+  ASSERT(read_image("img/PrtMimi.png", &first) == IMG_SUCCESS);
+  ASSERT(first.mapped_len == 0);
+  ASSERT(read_image("img/PrtMimi.png", &second) == IMG_SUCCESS);
+  ASSERT(second.mapped_len != 0);
+  ASSERT(second.width == objs->tilemap.width && second.height == objs->tilemap.height);
+  ASSERT(memcmp(second.data, objs->tilemap.data, size) == 0);
+
+  // a cached image can be drawn on without changing the cache
+  second.data[0] = 0x12345678;
+  free_image(&second);
+  ASSERT(read_image("img/PrtMimi.png", &second) == IMG_SUCCESS);
+  ASSERT(second.data[0] == objs->tilemap.data[0]);
+  free_image(&second);
+  free_image(&first);
+  ASSERT(first.data == NULL);
+
+  image_cache_get_stats(&after);
+  ASSERT(after.hits - before.hits == 2 && after.misses - before.misses == 1);
+  ASSERT(after.stores - before.stores == 1);
+
+  // with a limit smaller than the image, nothing stays cached
+  ASSERT(image_cache_enable(dir, size / 2) == IMG_SUCCESS);
+  ASSERT(read_image("img/NpcGuest.png", &objs->spritemap) == IMG_SUCCESS);
+  ASSERT(objs->spritemap.mapped_len == 0);
+  image_cache_get_stats(&before);
+  ASSERT(before.stores == after.stores);
+
+  // storing another image evicts the least recently used one, when
+  // the cache only has room for one of them
+  uint64_t sprites_size = (uint64_t) objs->spritemap.width * objs->spritemap.height * sizeof(uint32_t);
+  ASSERT(image_cache_enable(dir, (size > sprites_size ? size : sprites_size) + 4096) == IMG_SUCCESS);
+  struct Image sprites;
+  ASSERT(read_image("img/NpcGuest.png", &sprites) == IMG_SUCCESS);
+  free_image(&sprites);
+  image_cache_get_stats(&before);
+  ASSERT(before.evictions - after.evictions == 1);
+  ASSERT(read_image("img/NpcGuest.png", &sprites) == IMG_SUCCESS);
+  ASSERT(sprites.mapped_len != 0);
+  free_image(&sprites);
+
+  image_cache_disable();
+  ASSERT(read_image("img/NpcGuest.png", &sprites) == IMG_SUCCESS);
+  ASSERT(sprites.mapped_len == 0);
+  free_image(&sprites);
+
+  remove_dir(dir);
+}
+
+void test_read_image_from_memory(TestObjs *objs) {
+  ASSERT(read_image("img/NpcGuest.png", &objs->spritemap) == IMG_SUCCESS);
+
+  FILE *f = fopen("img/NpcGuest.png", "rb");
+  ASSERT(f != NULL);
+  unsigned char *buf = malloc(64 * 1024);
+  size_t len = fread(buf, 1, 64 * 1024, f);
+  fclose(f);
+  ASSERT(len > 0 && len < 64 * 1024);
+
+  struct Image img;
+  ASSERT(read_image_from_memory(buf, len, &img) == IMG_SUCCESS);
+  ASSERT(img.width == objs->spritemap.width && img.height == objs->spritemap.height);
+  ASSERT(memcmp(img.data, objs->spritemap.data, (size_t) img.width * img.height * sizeof(uint32_t)) == 0);
+  free_image(&img);
+
+  // truncated data and data that isn't a PNG are rejected
+  ASSERT(read_image_from_memory(buf, len / 2, &img) != IMG_SUCCESS);
+  ASSERT(read_image_from_memory(buf, 20, &img) == IMG_ERR_COULD_NOT_OPEN);
+  ASSERT(read_image_from_memory(buf + 1, len - 1, &img) == IMG_ERR_COULD_NOT_OPEN);
+  free(buf);
+}
+
+// Check the filter kernels for one pixel size on random rows of every
+// length up to 40 pixels: filtering is undone by unfiltering, the
+// SIMD kernels agree with the scalar ones, and the chosen filter has
+// the smallest cost. Half of the rows only use a few byte values, so
+// that the Paeth predictor's ties are exercised.
+void check_filter_kernels(int bpp) {
+  unsigned char prev[40 * 8], row[40 * 8], expected[40 * 8], actual[40 * 8];
+  static const unsigned char few[] = { 0, 1, 2, 127, 128, 254, 255 };
+
+  for (int trial = 0; trial < 8; trial++) {
+    for (size_t len = 0; len <= sizeof(prev) / 8 * bpp; len++) {
+      for (size_t i = 0; i < len; i++) {
+        prev[i] = (trial % 4 == 3) ? 0 : (trial & 1) ? few[rand() % 7] : (unsigned char) rand();
+        row[i] = (trial & 1) ? few[rand() % 7] : (unsigned char) rand();
+      }
+
+      uint64_t costs[PNG_NUM_FILTERS];
+      filter_costs_scalar(bpp, row, prev, len, costs);
+      for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+        ASSERT(filter_row_scalar(filter, bpp, row, prev, expected, len) == 0);
+        ASSERT(filter_row(filter, bpp, row, prev, actual, len) == 0);
+        ASSERT(memcmp(expected, actual, len) == 0);
+        ASSERT(unfilter_row_scalar(filter, bpp, actual, prev, len) == 0);
+        ASSERT(memcmp(row, actual, len) == 0);
+      }
+#ifdef PNG_UNFILTER_HAVE_X86
+      uint64_t simd_costs[PNG_NUM_FILTERS];
+      filter_costs_sse2(bpp, row, prev, len, simd_costs);
+      ASSERT(memcmp(costs, simd_costs, sizeof(costs)) == 0);
+#endif
+      int best = choose_filter(bpp, row, prev, len);
+      for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; filter++) {
+        ASSERT(costs[best] < costs[filter] || (costs[best] == costs[filter] && best <= filter));
+      }
+    }
+  }
+}
+
+void test_filter_kernels(TestObjs *objs) {
+  (void) objs;
+  srand(42);
+  for (int bpp = 1; bpp <= 8; bpp++) {
+    check_filter_kernels(bpp);
+  }
+
+  // the cost of a byte is its distance from zero, wrapping around
+  const unsigned char row[4] = { 0, 1, 255, 128 }, zeros[4] = { 0 };
+  uint64_t costs[PNG_NUM_FILTERS];
+  filter_costs_scalar(4, row, zeros, 4, costs);
+  ASSERT(costs[PNG_FILTER_NONE] == 0 + 1 + 1 + 128);
+
+  unsigned char out[4];
+  ASSERT(filter_row_scalar(5, 4, row, zeros, out, 4) == -1);
+  ASSERT(filter_row(5, 4, row, zeros, out, 4) == -1);
+}
+
+void test_write_filters(TestObjs *objs) {
+  (void) objs;
+  // a canvas rendered by the driver
+  struct Image canvas;
+  ASSERT(read_image("expected/example01.png", &canvas) == IMG_SUCCESS);
+  char filename[] = "/tmp/test_filter_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT(fd >= 0);
+  close(fd);
+
+  // every filter gives back the same pixels
+  long sizes[IMG_FILTER_PAETH + 2];
+  for (int filter = IMG_FILTER_ADAPTIVE; filter <= IMG_FILTER_PAETH; filter++) {
+    ASSERT(image_set_write_filter(filter) == IMG_SUCCESS);
+    ASSERT(write_image(filename, &canvas) == IMG_SUCCESS);
+
+    struct Image img;
+    ASSERT(read_image(filename, &img) == IMG_SUCCESS);
+    ASSERT(img.width == canvas.width && img.height == canvas.height);
+    ASSERT(memcmp(img.data, canvas.data,
+                  (size_t) img.width * img.height * sizeof(uint32_t)) == 0);
+    free_image(&img);
+
+    FILE *f = fopen(filename, "rb");
+    ASSERT(f != NULL && fseek(f, 0, SEEK_END) == 0);
+    sizes[filter + 1] = ftell(f);
+    fclose(f);
+  }
+  ASSERT(image_set_write_filter(IMG_FILTER_PAETH + 1) == IMG_ERR_COULD_NOT_WRITE);
+  ASSERT(image_set_write_filter(IMG_FILTER_ADAPTIVE) == IMG_SUCCESS);
+  unlink(filename);
+  free_image(&canvas);
+
+  // choosing the filter of each row beats not filtering rendered
+  // shapes (though not always flat pixel art, such as img/*.png)
+  ASSERT(sizes[IMG_FILTER_ADAPTIVE + 1] < sizes[IMG_FILTER_NONE + 1]);
+}
+
+// Write an image with the given compression settings, check that
+// it reads back unchanged, and return the file's size.
+long write_with_options(const char *filename, struct Image *img, const struct ImageWriteOptions *opts) {
+  ASSERT(write_image_ex(filename, img, opts) == IMG_SUCCESS);
+
+  struct Image copy;
+  ASSERT(read_image(filename, &copy) == IMG_SUCCESS);
+  ASSERT(copy.width == img->width && copy.height == img->height);
+  ASSERT(memcmp(copy.data, img->data, (size_t) img->width * img->height * sizeof(uint32_t)) == 0);
+  free_image(&copy);
+
+  FILE *f = fopen(filename, "rb");
+  ASSERT(f != NULL && fseek(f, 0, SEEK_END) == 0);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+void test_write_options(TestObjs *objs) {
+  ASSERT(read_image("img/NpcGuest.png", &objs->spritemap) == IMG_SUCCESS);
+  char filename[] = "/tmp/test_options_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT(fd >= 0);
+  close(fd);
+
+  struct ImageWriteOptions opts;
+  init_write_options(&opts);
+  long default_size = write_with_options(filename, &objs->spritemap, &opts);
+  ASSERT(write_with_options(filename, &objs->spritemap, NULL) == default_size);
+
+  // storing the data uncompressed makes the largest file
+  opts.level = IMG_LEVEL_NONE;
+  long stored_size = write_with_options(filename, &objs->spritemap, &opts);
+  ASSERT(stored_size > default_size);
+  ASSERT(stored_size > (long) objs->spritemap.width * objs->spritemap.height * 4);
+
+  opts.level = IMG_LEVEL_SMALLEST;
+  ASSERT(write_with_options(filename, &objs->spritemap, &opts) <= default_size);
+
+  for (int strategy = IMG_STRATEGY_DEFAULT; strategy <= IMG_STRATEGY_FIXED; strategy++) {
+    init_write_options(&opts);
+    opts.level = IMG_LEVEL_FASTEST;
+    opts.strategy = strategy;
+    opts.window_bits = 9 + strategy;
+    opts.mem_level = 1 + 2 * strategy;
+    ASSERT(write_with_options(filename, &objs->spritemap, &opts) < stored_size);
+  }
+
+  // settings out of range are rejected before the file is created
+  unlink(filename);
+  init_write_options(&opts);
+  opts.level = 10;
+  ASSERT(write_image_ex(filename, &objs->spritemap, &opts) == IMG_ERR_INVALID_OPTIONS);
+  init_write_options(&opts);
+  opts.strategy = IMG_STRATEGY_FIXED + 1;
+  ASSERT(write_image_ex(filename, &objs->spritemap, &opts) == IMG_ERR_INVALID_OPTIONS);
+  init_write_options(&opts);
+  opts.window_bits = 8;
+  ASSERT(write_image_ex(filename, &objs->spritemap, &opts) == IMG_ERR_INVALID_OPTIONS);
+  init_write_options(&opts);
+  opts.mem_level = 0;
+  ASSERT(write_image_ex(filename, &objs->spritemap, &opts) == IMG_ERR_INVALID_OPTIONS);
+  ASSERT(access(filename, F_OK) != 0);
+}
+
+void test_write_threads(TestObjs *objs) {
+  (void) objs;
+  // an image of several bands (of 512 KiB of rows each)
+  struct Image img;
+  ASSERT(init_image(&img, 700, 600) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < img.width * img.height; i++) {
+    img.data[i] = (i % 700) * 0x01030500U ^ (i / 700) * 0x07000300U ^ 0xFF;
+  }
+  struct Rect rect = { .x = 100, .y = 50, .width = 300, .height = 400 };
+  draw_rect(&img, &rect, 0x20408080);
+  draw_circle(&img, 350, 300, 200, 0xC0A00060);
+
+  char filename[] = "/tmp/test_threads_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT(fd >= 0);
+  close(fd);
+
+  struct ImageWriteOptions opts;
+  init_write_options(&opts);
+  long serial_size = write_with_options(filename, &img, &opts);
+
+  // the bands are compressed the same way whatever the number of
+  // threads, and cost little space
+  opts.threads = 2;
+  long banded_size = write_with_options(filename, &img, &opts);
+  ASSERT(banded_size < serial_size + serial_size / 50 + 64);
+  opts.threads = 5;
+  ASSERT(write_with_options(filename, &img, &opts) == banded_size);
+
+  opts.level = IMG_LEVEL_SMALLEST;
+  opts.window_bits = 9;
+  opts.mem_level = 1;
+  write_with_options(filename, &img, &opts);
+  init_write_options(&opts);
+  opts.threads = 3;
+  opts.strategy = IMG_STRATEGY_RLE;
+  write_with_options(filename, &img, &opts);
+
+  // rows written in groups
+  struct ImageWriter *writer;
+  ASSERT(open_image_writer_ex(filename, img.width, img.height, &opts, &writer) == IMG_SUCCESS);
+  for (uint32_t y = 0; y < img.height; y += 7) {
+    uint32_t rows = img.height - y < 7 ? img.height - y : 7;
+    ASSERT(write_image_rows(writer, img.data + (uint64_t) y * img.width, rows) == IMG_SUCCESS);
+  }
+  ASSERT(close_image_writer(writer) == IMG_SUCCESS);
+  struct Image copy;
+  ASSERT(read_image(filename, &copy) == IMG_SUCCESS);
+  ASSERT(memcmp(copy.data, img.data, (size_t) img.width * img.height * sizeof(uint32_t)) == 0);
+  free_image(&copy);
+
+  unlink(filename);
+  opts.threads = 0;
+  ASSERT(write_image_ex(filename, &img, &opts) == IMG_ERR_INVALID_OPTIONS);
+  free_image(&img);
+}
+
+// Record a white background and a circle whose bounding box is far
+// larger than the int32_t range.
+void record_huge_circle(struct DrawList *list) {
+  struct Rect background = { .x = 0, .y = 0, .width = 20, .height = 20 };
+  drawlist_init(list);
+  ASSERT(drawlist_add_rect(list, &background, 0xFFFFFFFF) == 0);
+  ASSERT(drawlist_add_circle(list, 5, 5, 1500000000, 0xFF0000FF) == 0);
+}
+
+// Record a green background and rectangles whose right or bottom
+// edge is beyond the int32_t range.
+void record_overflowing_rects(struct DrawList *list) {
+  struct Rect background = { .x = 0, .y = 0, .width = 10, .height = 10 };
+  struct Rect tall = { .x = 0, .y = 3, .width = 10, .height = INT32_MAX };
+  struct Rect wide = { .x = 3, .y = 0, .width = INT32_MAX, .height = 2 };
+  drawlist_init(list);
+  ASSERT(drawlist_add_rect(list, &background, 0x00FF00FF) == 0);
+  ASSERT(drawlist_add_rect(list, &tall, 0xFF0000FF) == 0);
+  ASSERT(drawlist_add_rect(list, &wide, 0x0000FFFF) == 0);
+}
+
+// Check that an image holds the same pixels as the expected one.
+void check_same_pixels(const struct Image *img, const struct Image *expected) {
+  ASSERT(img->width == expected->width && img->height == expected->height);
+  ASSERT(memcmp(img->data, expected->data,
+                (size_t) img->width * img->height * sizeof(uint32_t)) == 0);
+}
+
+// Check that every renderer, and render_serial after each optimization
+// pass, draws the commands recorded by record the same as render_serial
+// does (the expected image).
+void check_render_modes(void (*record)(struct DrawList *), const struct Image *expected) {
+  uint32_t width = expected->width, height = expected->height;
+  struct DrawList list;
+  struct Image img;
+  record(&list);
+
+  ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+  render_bands(&img, &list, 3);
+  check_same_pixels(&img, expected);
+  free_image(&img);
+  ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+  render_tiles(&img, &list, 2, 8, NULL);
+  check_same_pixels(&img, expected);
+  free_image(&img);
+  ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+  render_dag(&img, &list, 2, NULL);
+  check_same_pixels(&img, expected);
+  free_image(&img);
+
+  char filename[] = "/tmp/test_modes_XXXXXX";
+  int fd = mkstemp(filename);
+  ASSERT(fd >= 0);
+  close(fd);
+  ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+  ASSERT(render_pipelined(&img, &list, filename, NULL, 4, NULL) == IMG_SUCCESS);
+  free_image(&img);
+  ASSERT(read_image(filename, &img) == IMG_SUCCESS);
+  check_same_pixels(&img, expected);
+  free_image(&img);
+  ASSERT(render_streamed(width, height, &list, filename, NULL, 4, NULL) == IMG_SUCCESS);
+  ASSERT(read_image(filename, &img) == IMG_SUCCESS);
+  check_same_pixels(&img, expected);
+  free_image(&img);
+  unlink(filename);
+  drawlist_free(&list);
+
+  int (*passes[])(struct DrawList *, uint32_t, uint32_t, struct OptStats *) = {
+    drawlist_cull_occluded, drawlist_coalesce, drawlist_schedule,
+  };
+  for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+    record(&list);
+    ASSERT(passes[i](&list, width, height, NULL) == 0);
+    ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+    render_serial(&img, &list);
+    check_same_pixels(&img, expected);
+    free_image(&img);
+    drawlist_free(&list);
+  }
+}
+
+void test_render_huge_circle(TestObjs *objs) {
+  (void) objs;
+  struct DrawList list;
+  struct Image expected;
+  record_huge_circle(&list);
+  ASSERT(init_image(&expected, 20, 20) == IMG_SUCCESS);
+  render_serial(&expected, &list);
+  drawlist_free(&list);
+
+  // the circle covers the whole canvas
+  ASSERT(expected.data[0] == 0xFF0000FF && expected.data[399] == 0xFF0000FF);
+  check_render_modes(record_huge_circle, &expected);
+  free_image(&expected);
+}
+
+void test_render_overflowing_rects(TestObjs *objs) {
+  (void) objs;
+  struct DrawList list;
+  struct Image expected;
+  record_overflowing_rects(&list);
+  ASSERT(init_image(&expected, 10, 10) == IMG_SUCCESS);
+  render_serial(&expected, &list);
+  drawlist_free(&list);
+
+  // the rectangles reach the right and bottom edges of the canvas
+  ASSERT(expected.data[0] == 0x00FF00FF && expected.data[20] == 0x00FF00FF);
+  ASSERT(expected.data[3] == 0x0000FFFF && expected.data[19] == 0x0000FFFF);
+  ASSERT(expected.data[30] == 0xFF0000FF && expected.data[99] == 0xFF0000FF);
+  check_render_modes(record_overflowing_rects, &expected);
+  free_image(&expected);
+}
+
+void test_cull_overflowing_rects(TestObjs *objs) {
+  (void) objs;
+  struct DrawList list;
+  struct OptStats stats;
+  record_overflowing_rects(&list);
+  ASSERT(drawlist_cull_occluded(&list, 10, 10, &stats) == 0);
+
+  // the rectangles past the int32_t range hide the 84 pixels of the
+  // background they draw over, leaving its top left corner and row 2
+  ASSERT(stats.area_eliminated == 84);
+  ASSERT(list.num_cmds == 4);
+  ASSERT(list.cmds[0].rect.x == 0 && list.cmds[0].rect.y == 0);
+  ASSERT(list.cmds[0].rect.width == 3 && list.cmds[0].rect.height == 2);
+  ASSERT(list.cmds[1].rect.x == 0 && list.cmds[1].rect.y == 2);
+  ASSERT(list.cmds[1].rect.width == 10 && list.cmds[1].rect.height == 1);
+  ASSERT(list.cmds[2].rect.height == INT32_MAX && list.cmds[3].rect.width == INT32_MAX);
+  drawlist_free(&list);
+}
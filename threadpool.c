@@ -0,0 +1,143 @@
+/*
+ * Implementation of a simple thread pool that runs submitted tasks
+ * on a fixed set of worker threads.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+struct Task {
+  void (*fn)(void *);
+  void *arg;
+};
+
+struct ThreadPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;    // signaled when a task is queued or on shutdown
+  pthread_cond_t all_done;      // signaled when the last pending task finishes
+  struct Task *tasks;           // circular queue of tasks not yet started
+  size_t head, count, capacity;
+  size_t pending;               // tasks queued or running
+  int shutdown;
+  pthread_t *threads;
+  unsigned num_threads;
+};
+
+static void *worker_main(void *arg) {
+  struct ThreadPool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->count == 0 && !pool->shutdown) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->count == 0) {
+      break;
+    }
+    struct Task task = pool->tasks[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    pthread_mutex_unlock(&pool->lock);
+
+    task.fn(task.arg);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_broadcast(&pool->all_done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct ThreadPool *threadpool_create(unsigned num_threads) {
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  struct ThreadPool *pool = calloc(1, sizeof(struct ThreadPool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->threads = malloc(num_threads * sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->all_done, NULL);
+
+  for (unsigned i = 0; i < num_threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+      break;
+    }
+    pool->num_threads++;
+  }
+  if (pool->num_threads == 0) {
+    threadpool_destroy(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+int threadpool_submit(struct ThreadPool *pool, void (*fn)(void *), void *arg) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count == pool->capacity) {
+    // grow the queue, unwrapping it into the new array
+    size_t new_capacity = pool->capacity ? pool->capacity * 2 : 64;
+    struct Task *grown = malloc(new_capacity * sizeof(struct Task));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < pool->count; i++) {
+      grown[i] = pool->tasks[(pool->head + i) % pool->capacity];
+    }
+    free(pool->tasks);
+    pool->tasks = grown;
+    pool->head = 0;
+    pool->capacity = new_capacity;
+  }
+  pool->tasks[(pool->head + pool->count) % pool->capacity] = (struct Task) { fn, arg };
+  pool->count++;
+  pool->pending++;
+  pthread_cond_signal(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+void threadpool_wait(struct ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->all_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_destroy(struct ThreadPool *pool) {
+  threadpool_wait(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->all_done);
+  free(pool->tasks);
+  free(pool->threads);
+  free(pool);
+}
+
+unsigned threadpool_size(const struct ThreadPool *pool) {
+  return pool->num_threads;
+}
@@ -0,0 +1,59 @@
+/*
+ * Header of a simple thread pool that runs submitted tasks on a
+ * fixed set of worker threads.
+ * CSF Assignment 2
+ * Tianai Yue, Cassie Zhang
+ * tyue4@jhu.edu, xzhan304@jhu.edu
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+struct ThreadPool;
+
+// Create a thread pool.
+//
+// Parameters:
+//   num_threads - number of worker threads (at least 1 is used)
+//
+// Returns:
+//   pointer to the new pool, or NULL if it couldn't be created
+struct ThreadPool *threadpool_create(unsigned num_threads);
+
+// Queue a task to be run by one of the pool's workers. Tasks may
+// themselves submit more tasks.
+//
+// Parameters:
+//   pool - pointer to ThreadPool
+//   fn   - function to run
+//   arg  - argument passed to fn
+//
+// Returns:
+//   0 if successful, -1 if memory could not be allocated (in which
+//   case the task isn't queued, and the caller should run it itself)
+int threadpool_submit(struct ThreadPool *pool, void (*fn)(void *), void *arg);
+
+// Wait until every submitted task (including tasks submitted by
+// other tasks while waiting) has finished.
+//
+// Parameters:
+//   pool - pointer to ThreadPool
+void threadpool_wait(struct ThreadPool *pool);
+
+// Wait for all tasks to finish, then stop the workers and free
+// the pool.
+//
+// Parameters:
+//   pool - pointer to ThreadPool
+void threadpool_destroy(struct ThreadPool *pool);
+
+// Get the number of worker threads in a pool.
+//
+// Parameters:
+//   pool - pointer to ThreadPool
+//
+// Returns:
+//   the number of workers that were started
+unsigned threadpool_size(const struct ThreadPool *pool);
+
+#endif // THREADPOOL_H